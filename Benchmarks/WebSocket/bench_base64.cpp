@@ -0,0 +1,186 @@
+// ws/base64.hpp against OpenSSL BIO: every kernel is checked on random data, then the encode and decode speeds are measured.
+//   bench_base64
+#include "ws/base64.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <openssl/bio.h>
+#include <openssl/buffer.h>
+#include <openssl/evp.h>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace SimpleWeb::base64;
+
+static std::string openssl_encode(const std::string &input) {
+  BIO *base64 = BIO_new(BIO_f_base64());
+  BIO_set_flags(base64, BIO_FLAGS_BASE64_NO_NL);
+  BIO_push(base64, BIO_new(BIO_s_mem()));
+  BIO_write(base64, input.data(), static_cast<int>(input.size()));
+  (void)BIO_flush(base64);
+  BUF_MEM *memory;
+  BIO_get_mem_ptr(base64, &memory);
+  std::string result(memory->data, memory->length);
+  BIO_free_all(base64);
+  return result;
+}
+
+static std::string openssl_decode(const std::string &input) {
+  std::string result((6 * input.size()) / 8, '\0');
+  BIO *base64 = BIO_new(BIO_f_base64());
+  BIO_set_flags(base64, BIO_FLAGS_BASE64_NO_NL);
+  BIO_push(base64, BIO_new_mem_buf(input.data(), static_cast<int>(input.size())));
+  int size = BIO_read(base64, &result[0], static_cast<int>(result.size()));
+  result.resize(size > 0 ? size : 0);
+  BIO_free_all(base64);
+  return result;
+}
+
+/// encode() and decode() with the kernels up to this level instead of the best one of the CPU
+enum class Level { scalar, sse, avx2 };
+
+template <typename char_type>
+static std::size_t encode_with(Level level, const unsigned char *in, std::size_t size, char_type *out) {
+  auto start = out;
+  std::size_t done = 0;
+#ifdef SIMPLE_WEB_BASE64_X86
+  if(level >= Level::avx2)
+    done = detail::encode_avx2(in, size, out);
+  if(level >= Level::sse)
+    done += detail::encode_sse(in + done, size - done, out);
+#else
+  (void)level;
+#endif
+  out += detail::encode_scalar(in + done, size - done, out);
+  return static_cast<std::size_t>(out - start);
+}
+
+template <typename char_type>
+static bool decode_with(Level level, const char_type *in, std::size_t size, unsigned char *out, std::size_t &out_size) {
+  auto start = out;
+  std::size_t done = 0;
+#ifdef SIMPLE_WEB_BASE64_X86
+  if(level >= Level::avx2) {
+    done = detail::decode_avx2(in, size, out);
+    if(done > size)
+      return false;
+  }
+  if(level >= Level::sse) {
+    auto sse_done = detail::decode_sse(in + done, size - done, out);
+    if(sse_done > size - done)
+      return false;
+    done += sse_done;
+  }
+#else
+  (void)level;
+#endif
+  std::size_t tail_size;
+  if(!detail::decode_scalar(in + done, size - done, out, tail_size))
+    return false;
+  out_size = static_cast<std::size_t>(out - start) + tail_size;
+  return true;
+}
+
+int main() {
+#ifdef SIMPLE_WEB_BASE64_X86
+  const int cpu_level = detail::simd_level();
+#else
+  const int cpu_level = 0;
+#endif
+  std::mt19937 random(1);
+  const Level levels[] = {Level::scalar, Level::sse, Level::avx2};
+  const char junk[] = {'!', ' ', '\n', '-', '_', '.', '\0', static_cast<char>(0x80), static_cast<char>(0xff)};
+  int failures = 0;
+  auto fail = [&failures](const char *what, int level, std::size_t size) {
+    ++failures;
+    std::printf("%s failed, level %d, %zu bytes\n", what, level, size);
+  };
+
+  // every length up to 300, then random lengths, in 8- and 16-bit characters
+  for(int iteration = 0; iteration < 20000; ++iteration) {
+    std::size_t size = iteration < 300 ? iteration : random() % 5000;
+    std::string source(size, '\0');
+    for(auto &c : source)
+      c = static_cast<char>(random());
+    const std::string reference = openssl_encode(source);
+    std::string unpadded = reference;
+    while(!unpadded.empty() && unpadded.back() == '=')
+      unpadded.pop_back();
+
+    for(auto level : levels) {
+      int l = static_cast<int>(level);
+      if(l > cpu_level)
+        continue;
+      std::vector<char> encoded(encoded_size(size) + 1);
+      std::vector<char16_t> encoded16(encoded_size(size) + 1);
+      std::size_t encoded_length = encode_with(level, reinterpret_cast<const unsigned char *>(source.data()), size, encoded.data());
+      std::size_t encoded16_length = encode_with(level, reinterpret_cast<const unsigned char *>(source.data()), size, encoded16.data());
+      if(std::string(encoded.data(), encoded_length) != reference)
+        fail("encode", l, size);
+      if(encoded16_length != reference.size() || !std::equal(reference.begin(), reference.end(), encoded16.begin(), [](char a, char16_t b) { return static_cast<char16_t>(static_cast<unsigned char>(a)) == b; }))
+        fail("UTF-16 encode", l, size);
+
+      std::vector<unsigned char> decoded(decoded_size(reference.size()) + 1);
+      std::size_t decoded_length = 0;
+      if(!decode_with(level, reference.data(), reference.size(), decoded.data(), decoded_length) || decoded_length != size || std::memcmp(decoded.data(), source.data(), size) != 0)
+        fail("decode", l, size);
+      if(!decode_with(level, encoded16.data(), encoded16_length, decoded.data(), decoded_length) || decoded_length != size || std::memcmp(decoded.data(), source.data(), size) != 0)
+        fail("UTF-16 decode", l, size);
+      if(!decode_with(level, unpadded.data(), unpadded.size(), decoded.data(), decoded_length) || decoded_length != size || std::memcmp(decoded.data(), source.data(), size) != 0)
+        fail("unpadded decode", l, size);
+
+      // a corrupted character anywhere must be rejected
+      if(!reference.empty()) {
+        std::string corrupted = reference;
+        corrupted[random() % corrupted.size()] = junk[random() % sizeof(junk)];
+        if(decode_with(level, corrupted.data(), corrupted.size(), decoded.data(), decoded_length))
+          fail("rejecting corrupted input", l, size);
+        std::u16string corrupted16(encoded16.data(), encoded16_length);
+        corrupted16[random() % corrupted16.size()] = static_cast<char16_t>(0x100 + '/');
+        if(decode_with(level, corrupted16.data(), corrupted16.size(), decoded.data(), decoded_length))
+          fail("rejecting corrupted UTF-16 input", l, size);
+      }
+    }
+  }
+  std::printf("correctness: %d failures, SIMD level of this CPU %d\n", failures, cpu_level);
+
+  const std::size_t size = 4 << 20;
+  std::string source(size, '\0');
+  for(auto &c : source)
+    c = static_cast<char>(random());
+  const std::string encoded = openssl_encode(source);
+  const std::u16string encoded16(encoded.begin(), encoded.end());
+  std::vector<char> out(encoded_size(size));
+  std::vector<char16_t> out16(encoded_size(size));
+  std::vector<unsigned char> decoded(decoded_size(encoded.size()));
+  std::size_t decoded_length;
+  auto source_data = reinterpret_cast<const unsigned char *>(source.data());
+
+  // best of 15 runs, MB/s of the binary data, the kernels this CPU doesn't have are skipped
+  auto measure = [size, cpu_level](const char *name, const std::function<void()> &run, Level level = Level::scalar) {
+    if(static_cast<int>(level) > cpu_level)
+      return;
+    double best = 1e9;
+    for(int i = 0; i < 15; ++i) {
+      auto start = std::chrono::steady_clock::now();
+      run();
+      best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    std::printf("%-22s %6.0f MB/s\n", name, size / best / 1e6);
+  };
+  measure("encode OpenSSL BIO", [&] { openssl_encode(source); });
+  measure("encode scalar", [&] { encode_with(Level::scalar, source_data, size, out.data()); });
+  measure("encode SSSE3", [&] { encode_with(Level::sse, source_data, size, out.data()); }, Level::sse);
+  measure("encode AVX2", [&] { encode_with(Level::avx2, source_data, size, out.data()); }, Level::avx2);
+  measure("encode AVX2 UTF-16", [&] { encode_with(Level::avx2, source_data, size, out16.data()); }, Level::avx2);
+  measure("decode OpenSSL BIO", [&] { openssl_decode(encoded); });
+  measure("decode scalar", [&] { decode_with(Level::scalar, encoded.data(), encoded.size(), decoded.data(), decoded_length); });
+  measure("decode SSE4.1", [&] { decode_with(Level::sse, encoded.data(), encoded.size(), decoded.data(), decoded_length); }, Level::sse);
+  measure("decode AVX2", [&] { decode_with(Level::avx2, encoded.data(), encoded.size(), decoded.data(), decoded_length); }, Level::avx2);
+  measure("decode scalar UTF-16", [&] { decode_with(Level::scalar, encoded16.data(), encoded16.size(), decoded.data(), decoded_length); });
+  measure("decode AVX2 UTF-16", [&] { decode_with(Level::avx2, encoded16.data(), encoded16.size(), decoded.data(), decoded_length); }, Level::avx2);
+  return failures != 0;
+}
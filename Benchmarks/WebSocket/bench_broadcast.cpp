@@ -0,0 +1,196 @@
+// Broadcast throughput of the server to raw TCP clients on the loopback, the clients only parse the frame headers.
+//   bench_broadcast [--messages N] [--audio-every K] [--deflate] [--clients C] [--max-write-size B]
+// --audio-every K: every Kth message is a base64 audio chunk (12814 bytes) instead of a gaze sample (about 260 bytes)
+// --deflate: the clients offer permessage-deflate, the messages are compressed
+// --max-write-size B: Config::max_write_size, 1 writes every message on its own
+#include "ws/server_ws.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <random>
+
+using WsServer = SimpleWeb::SocketServer<SimpleWeb::WS>;
+
+struct Options {
+  std::size_t messages = 300000;
+  std::size_t audio_every = 0;
+  bool deflate = false;
+  std::size_t clients = 1;
+  std::size_t max_write_size = 256 * 1024;
+};
+
+static bool parse_options(int argc, char **argv, Options &options) {
+  for(int i = 1; i < argc; ++i) {
+    std::string name = argv[i];
+    if(name == "--deflate") {
+      options.deflate = true;
+      continue;
+    }
+    if(i + 1 >= argc)
+      return false;
+    std::size_t value = std::strtoull(argv[++i], nullptr, 10);
+    if(name == "--messages")
+      options.messages = value;
+    else if(name == "--audio-every")
+      options.audio_every = value;
+    else if(name == "--clients")
+      options.clients = std::max<std::size_t>(value, 1);
+    else if(name == "--max-write-size")
+      options.max_write_size = value;
+    else
+      return false;
+  }
+  return true;
+}
+
+static std::vector<std::shared_ptr<WsServer::OutMessage>> make_messages(const Options &options) {
+  std::mt19937 random(7);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::vector<std::shared_ptr<WsServer::OutMessage>> gaze(1000);
+  for(std::size_t i = 0; i < gaze.size(); ++i) {
+    char json[512];
+    std::snprintf(json, sizeof(json), "{\"Gaze\": {\"uv\": {\"x\": %f, \"y\": %f}, \"origin\": {\"x\": %f, \"y\": %f, \"z\": %f}, "
+                                      "\"direction\": {\"x\": %f, \"y\": %f, \"z\": %f}, \"lpdmm\": %f, \"rpdmm\": %f, \"cf\": %f, \"AOI_index\": %d}, \"Time\": %f}",
+                  uniform(random), uniform(random), uniform(random) * 10, uniform(random) * 10 + 150, uniform(random) * 10,
+                  uniform(random), uniform(random), uniform(random), 3 + uniform(random), 3 + uniform(random), uniform(random), int(i % 40), i * 8.3);
+    gaze[i] = std::make_shared<WsServer::OutMessage>();
+    *gaze[i] << json;
+  }
+  // 200 ms of 24 kHz 16-bit PCM each, distinct chunks so that deflate doesn't find the previous one in its window
+  std::vector<std::shared_ptr<WsServer::OutMessage>> audio(16);
+  for(auto &chunk : audio) {
+    std::string pcm(9600, '\0');
+    for(std::size_t i = 0; i + 1 < pcm.size(); i += 2) {
+      auto sample = static_cast<int16_t>(3000 * std::sin(i * 0.01) + random() % 200);
+      std::memcpy(&pcm[i], &sample, sizeof(sample));
+    }
+    chunk = std::make_shared<WsServer::OutMessage>();
+    *chunk << "{\"Speech\": \"" << SimpleWeb::Crypto::Base64::encode(pcm) << "\"}";
+  }
+
+  std::vector<std::shared_ptr<WsServer::OutMessage>> messages(options.messages);
+  for(std::size_t i = 0; i < messages.size(); ++i)
+    messages[i] = options.audio_every && i % options.audio_every == 0 ? audio[i / options.audio_every % audio.size()] : gaze[i % gaze.size()];
+  return messages;
+}
+
+class Client {
+public:
+  asio::io_context io_context;
+  asio::ip::tcp::socket socket{io_context};
+  std::size_t frames = 0, bytes = 0;
+
+  void connect(unsigned short port, bool deflate) {
+    socket.connect(asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), port));
+    socket.set_option(asio::ip::tcp::no_delay(true));
+    std::string request = "GET /broadcast HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                          "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n";
+    if(deflate)
+      request += "Sec-WebSocket-Extensions: permessage-deflate\r\n";
+    request += "\r\n";
+    asio::write(socket, asio::buffer(request));
+    asio::read_until(socket, buffer, "\r\n\r\n");
+    auto data = buffer.data();
+    std::string response(asio::buffers_begin(data), asio::buffers_end(data));
+    buffer.consume(response.find("\r\n\r\n") + 4);
+  }
+
+  /// Reads until count data frames are received
+  void receive(std::size_t count) {
+    while(frames < count) {
+      if(!parse_frame()) {
+        error_code ec;
+        auto size = socket.read_some(buffer.prepare(1 << 20), ec);
+        if(ec)
+          return;
+        buffer.commit(size);
+      }
+    }
+  }
+
+private:
+  using error_code = asio::error_code;
+  asio::streambuf buffer;
+
+  bool parse_frame() {
+    auto data = static_cast<const unsigned char *>(buffer.data().data());
+    std::size_t available = buffer.size();
+    if(available < 2)
+      return false;
+    std::size_t header_size = 2, length = data[1] & 0x7f;
+    if(length == 126)
+      header_size = 4;
+    else if(length == 127)
+      header_size = 10;
+    if(available < header_size)
+      return false;
+    if(header_size > 2) {
+      length = 0;
+      for(std::size_t i = 2; i < header_size; ++i)
+        length = (length << 8) | data[i];
+    }
+    if(available < header_size + length)
+      return false;
+    auto opcode = data[0] & 0x0f;
+    if(opcode == 1 || opcode == 2)
+      ++frames;
+    bytes += header_size + length;
+    buffer.consume(header_size + length);
+    return true;
+  }
+};
+
+int main(int argc, char **argv) {
+  Options options;
+  if(!parse_options(argc, argv, options)) {
+    std::printf("bench_broadcast [--messages N] [--audio-every K] [--deflate] [--clients C] [--max-write-size B]\n");
+    return 1;
+  }
+  auto messages = make_messages(options);
+
+  WsServer server;
+  server.config.port = 0;
+  server.config.address = "127.0.0.1";
+  server.config.permessage_deflate.enabled = options.deflate;
+  server.config.max_write_size = options.max_write_size;
+  std::atomic<std::size_t> open(0);
+  server.endpoint["^/broadcast/?$"].on_open = [&open](std::shared_ptr<WsServer::Connection>) { ++open; };
+  std::promise<unsigned short> port;
+  std::thread server_thread([&server, &port] { server.start([&port](unsigned short assigned_port) { port.set_value(assigned_port); }); });
+  auto server_port = port.get_future().get();
+
+  std::vector<std::unique_ptr<Client>> clients;
+  for(std::size_t i = 0; i < options.clients; ++i) {
+    clients.emplace_back(new Client());
+    clients.back()->connect(server_port, options.deflate);
+  }
+  while(open < options.clients)
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> client_threads;
+  for(auto &client : clients)
+    client_threads.emplace_back([&client, &options] { client->receive(options.messages); });
+  for(auto &message : messages)
+    server.broadcast(message);
+  for(auto &thread : client_threads)
+    thread.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::size_t frames = 0, bytes = 0, payload = 0;
+  for(auto &client : clients) {
+    frames += client->frames;
+    bytes += client->bytes;
+  }
+  for(auto &message : messages)
+    payload += message->size() * options.clients;
+  std::printf("clients %zu%s: %zu/%zu messages in %.3f s, %.0f messages/s, %.1f MB/s on the wire (%.0f%% of the payload)\n",
+              options.clients, options.deflate ? ", deflate" : "", frames, options.messages * options.clients, seconds,
+              frames / seconds, bytes / seconds / 1e6, 100.0 * bytes / payload);
+
+  server.stop();
+  server_thread.join();
+  return frames == options.messages * options.clients ? 0 : 1;
+}
@@ -0,0 +1,66 @@
+// permessage-deflate on the server's messages: compressed size and time per message, with and without context takeover.
+//   bench_deflate
+#include "ws/server_ws.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <random>
+
+using namespace SimpleWeb;
+
+int main() {
+  std::mt19937 random(7);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  auto gaze = [&](int i) {
+    char json[512];
+    std::snprintf(json, sizeof(json), "{\"Gaze\": {\"uv\": {\"x\": %f, \"y\": %f}, \"origin\": {\"x\": %f, \"y\": %f, \"z\": %f}, "
+                                      "\"direction\": {\"x\": %f, \"y\": %f, \"z\": %f}, \"lpdmm\": %f, \"rpdmm\": %f, \"cf\": %f, \"AOI_index\": %d}, \"Time\": %f}",
+                  uniform(random), uniform(random), uniform(random) * 10, uniform(random) * 10 + 150, uniform(random) * 10,
+                  uniform(random), uniform(random), uniform(random), 3 + uniform(random), 3 + uniform(random), uniform(random), i % 40, i * 8.3);
+    return std::string(json);
+  };
+  auto wall_log = [&](int i) {
+    std::string json = "{\"WallLog\": {\"action\": \"add\", \"wall\": \"Wall 1\", \"words\": [";
+    for(int word = 0; word < i % 20 + 1; ++word)
+      json += "\"word" + std::to_string(word) + "\", ";
+    return json + "\"end\"]}}";
+  };
+  auto audio = [&](int) {
+    // 200 ms of 24 kHz 16-bit PCM
+    std::string pcm(9600, '\0');
+    for(std::size_t i = 0; i + 1 < pcm.size(); i += 2) {
+      auto sample = static_cast<int16_t>(3000 * std::sin(i * 0.01) + random() % 200);
+      std::memcpy(&pcm[i], &sample, sizeof(sample));
+    }
+    return "{\"Speech\": \"" + Crypto::Base64::encode(pcm) + "\"}";
+  };
+
+  struct Kind {
+    const char *name;
+    std::function<std::string(int)> make;
+    int count;
+  };
+  for(auto &kind : std::vector<Kind>{{"gaze", gaze, 20000}, {"wall log", wall_log, 5000}, {"audio chunk", audio, 500}}) {
+    std::vector<std::string> messages;
+    for(int i = 0; i < kind.count; ++i)
+      messages.emplace_back(kind.make(i));
+    for(bool context_takeover : {true, false}) {
+      PermessageDeflate::Parameters parameters;
+      parameters.server_no_context_takeover = !context_takeover;
+      PermessageDeflate deflate(parameters, Z_DEFAULT_COMPRESSION);
+      std::size_t in = 0, out = 0;
+      auto start = std::chrono::steady_clock::now();
+      for(auto &message : messages) {
+        asio::streambuf compressed;
+        if(!deflate.compress(message.data(), message.size(), compressed))
+          compressed.commit(asio::buffer_copy(compressed.prepare(message.size()), asio::buffer(message)));
+        in += message.size();
+        out += compressed.size();
+      }
+      double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count() / messages.size();
+      std::printf("%-12s %-19s %6zu B -> %6zu B (%2.0f%% saved), %6.2f us/message\n", kind.name, context_takeover ? "context takeover," : "no context takeover,",
+                  in / messages.size(), out / messages.size(), 100.0 * (1.0 - double(out) / in), us);
+    }
+  }
+}
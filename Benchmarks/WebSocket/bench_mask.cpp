@@ -0,0 +1,63 @@
+// Unmasking of received frames: the former byte loop through std::istream/std::ostream against SimpleWeb::apply_mask.
+//   bench_mask
+#include "ws/server_ws.hpp"
+#include <chrono>
+#include <cstdio>
+#include <random>
+
+using namespace SimpleWeb;
+
+int main() {
+  const std::array<unsigned char, 4> mask{{0x12, 0x34, 0x56, 0x78}};
+
+  // apply_mask against the definition, all the alignments of the head and the tail
+  for(std::size_t size = 0; size < 300; ++size) {
+    std::string source(size, '\0'), destination(size, '\0');
+    for(std::size_t i = 0; i < size; ++i)
+      source[i] = static_cast<char>(i * 7);
+    apply_mask(reinterpret_cast<const unsigned char *>(source.data()), reinterpret_cast<unsigned char *>(&destination[0]), size, mask);
+    for(std::size_t i = 0; i < size; ++i) {
+      if(static_cast<unsigned char>(destination[i]) != (static_cast<unsigned char>(source[i]) ^ mask[i % 4])) {
+        std::printf("apply_mask is wrong at %zu of %zu bytes\n", i, size);
+        return 1;
+      }
+    }
+  }
+
+  for(std::size_t size : {std::size_t(1024), std::size_t(64 * 1024), std::size_t(8 * 1024 * 1024)}) {
+    std::string payload(size, '\0');
+    std::mt19937 random(3);
+    for(auto &c : payload)
+      c = static_cast<char>(random());
+    const std::size_t iterations = (std::size_t(256) * 1024 * 1024) / size;
+    std::size_t checksum = 0;
+
+    auto start = std::chrono::steady_clock::now();
+    for(std::size_t i = 0; i < iterations; ++i) {
+      asio::streambuf in, out;
+      std::ostream(&in).write(payload.data(), static_cast<std::streamsize>(size));
+      std::istream istream(&in);
+      std::ostream ostream(&out);
+      for(std::size_t c = 0; c < size; ++c)
+        ostream.put(static_cast<char>(istream.get() ^ mask[c % 4]));
+      checksum += out.size();
+    }
+    auto middle = std::chrono::steady_clock::now();
+    for(std::size_t i = 0; i < iterations; ++i) {
+      asio::streambuf in, out;
+      std::ostream(&in).write(payload.data(), static_cast<std::streamsize>(size));
+      auto source = static_cast<const unsigned char *>(in.data().data());
+      auto destination = static_cast<unsigned char *>(out.prepare(size).data());
+      apply_mask(source, destination, size, mask);
+      out.commit(size);
+      in.consume(size);
+      checksum += out.size();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double byte_loop = std::chrono::duration<double>(middle - start).count();
+    double bulk = std::chrono::duration<double>(end - middle).count();
+    std::printf("%8zu B: byte loop %7.1f MB/s, apply_mask %7.1f MB/s, x%.1f (checksum %zu)\n", size,
+                iterations * size / byte_loop / 1e6, iterations * size / bulk / 1e6, byte_loop / bulk, checksum);
+  }
+}
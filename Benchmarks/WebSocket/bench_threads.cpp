@@ -0,0 +1,80 @@
+// Server thread pool under load: SimpleWeb clients each echo messages while they receive broadcasts,
+// the broadcasts must arrive in order on every connection.
+//   bench_threads [threads] [clients] [broadcasts]
+#include "ws/client_ws.hpp"
+#include "ws/server_ws.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+
+using WsServer = SimpleWeb::SocketServer<SimpleWeb::WS>;
+using WsClient = SimpleWeb::SocketClient<SimpleWeb::WS>;
+
+int main(int argc, char **argv) {
+  const std::size_t threads = argc > 1 ? std::strtoull(argv[1], nullptr, 10) : 4;
+  const std::size_t clients = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 48;
+  const std::size_t broadcasts = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 2000;
+  const std::size_t echoes = 50;
+
+  WsServer server;
+  server.config.port = 0;
+  server.config.address = "127.0.0.1";
+  server.config.thread_pool_size = threads;
+  std::atomic<std::size_t> open(0);
+  auto &endpoint = server.endpoint["^/load/?$"];
+  endpoint.on_open = [&open](std::shared_ptr<WsServer::Connection>) { ++open; };
+  endpoint.on_message = [](std::shared_ptr<WsServer::Connection> connection, std::shared_ptr<WsServer::InMessage> in_message) {
+    connection->send(in_message->string());
+  };
+  std::promise<unsigned short> port;
+  std::thread server_thread([&server, &port] { server.start([&port](unsigned short assigned_port) { port.set_value(assigned_port); }); });
+  const std::string address = "127.0.0.1:" + std::to_string(port.get_future().get()) + "/load";
+
+  std::vector<std::unique_ptr<WsClient>> ws_clients;
+  std::vector<std::thread> client_threads;
+  std::vector<std::size_t> next(clients, 0);
+  std::atomic<std::size_t> received(0), echoed(0), out_of_order(0);
+  for(std::size_t i = 0; i < clients; ++i) {
+    ws_clients.emplace_back(new WsClient(address));
+    auto &client = *ws_clients.back();
+    client.on_open = [echoes](std::shared_ptr<WsClient::Connection> connection) {
+      for(std::size_t k = 0; k < echoes; ++k)
+        connection->send("echo");
+    };
+    client.on_message = [&, i, broadcasts](std::shared_ptr<WsClient::Connection> connection, std::shared_ptr<WsClient::InMessage> in_message) {
+      auto message = in_message->string();
+      if(message == "echo") {
+        ++echoed;
+        return;
+      }
+      std::size_t index = std::strtoull(message.c_str() + 2, nullptr, 10);
+      if(index != next[i])
+        ++out_of_order;
+      next[i] = index + 1;
+      ++received;
+      if(index == broadcasts - 1)
+        connection->send_close(1000);
+    };
+    client_threads.emplace_back([&client] { client.start(); });
+  }
+  while(open < clients)
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+  auto start = std::chrono::steady_clock::now();
+  const std::string padding(200, 'x');
+  for(std::size_t i = 0; i < broadcasts; ++i) {
+    auto out_message = std::make_shared<WsServer::OutMessage>();
+    *out_message << "b " << i << " " << padding;
+    server.broadcast(out_message);
+  }
+  for(auto &thread : client_threads)
+    thread.join();
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+  std::printf("threads %zu, clients %zu: %zu/%zu broadcasts received, %zu out of order, %zu/%zu echoes, %.0f deliveries/s\n",
+              threads, clients, received.load(), clients * broadcasts, out_of_order.load(), echoed.load(), clients * echoes, received / seconds);
+  server.stop();
+  server_thread.join();
+  return received == clients * broadcasts && out_of_order == 0 && echoed == clients * echoes ? 0 : 1;
+}
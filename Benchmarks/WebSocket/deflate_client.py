@@ -0,0 +1,87 @@
+# permessage-deflate client for deflate_echo, Python's zlib is the reference deflate implementation.
+#   python3 deflate_client.py [port]
+import socket, os, zlib, struct, base64, random, sys
+PORT = int(sys.argv[1]) if len(sys.argv) > 1 else 18182
+def connect(ext):
+    s=socket.create_connection(("127.0.0.1",PORT))
+    key=base64.b64encode(os.urandom(16)).decode()
+    req=f"GET /echo HTTP/1.1\r\nHost: x\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: {key}\r\nSec-WebSocket-Version: 13\r\n"
+    if ext: req+=f"Sec-WebSocket-Extensions: {ext}\r\n"
+    s.sendall((req+"\r\n").encode())
+    resp=b""
+    while b"\r\n\r\n" not in resp: resp+=s.recv(1)
+    hdr=[l for l in resp.decode().split("\r\n") if l.lower().startswith("sec-websocket-extensions")]
+    return s, (hdr[0].split(":",1)[1].strip() if hdr else None)
+def recvn(s,n):
+    b=b""
+    while len(b)<n:
+        c=s.recv(n-len(b))
+        if not c: raise EOFError
+        b+=c
+    return b
+def send(s,b0,payload):
+    m=os.urandom(4); n=len(payload)
+    h=bytes([b0])
+    if n<126: h+=bytes([0x80|n])
+    elif n<65536: h+=bytes([0x80|126])+struct.pack(">H",n)
+    else: h+=bytes([0x80|127])+struct.pack(">Q",n)
+    s.sendall(h+m+bytes(p^m[i%4] for i,p in enumerate(payload)))
+def recv(s):
+    b0,b1=recvn(s,2); n=b1&127
+    if n==126: n=struct.unpack(">H",recvn(s,2))[0]
+    elif n==127: n=struct.unpack(">Q",recvn(s,8))[0]
+    return b0, recvn(s,n)
+fails=0
+def check(c,msg):
+    global fails
+    if not c: fails+=1; print("FAIL",msg)
+# negotiation
+for offer,expect in [(None,None),("x-foo",None),("permessage-deflate","permessage-deflate"),
+    ("permessage-deflate; client_max_window_bits","permessage-deflate"),
+    ("permessage-deflate; server_max_window_bits=10","permessage-deflate; server_max_window_bits=10"),
+    ("permessage-deflate; server_max_window_bits=8, permessage-deflate","permessage-deflate"),
+    ("permessage-deflate; bogus","NONE"),
+    ("permessage-deflate; server_no_context_takeover; client_no_context_takeover","permessage-deflate; server_no_context_takeover")]:
+    s,ext=connect(offer); s.close()
+    if expect=="NONE": expect=None
+    check(ext==expect, f"{offer!r} -> {ext!r}")
+# round trips with context takeover
+for offer in ["permessage-deflate","permessage-deflate; server_no_context_takeover; server_max_window_bits=9"]:
+    s,ext=connect(offer)
+    comp=zlib.compressobj(wbits=-15); dec=zlib.decompressobj(wbits=-15)
+    rng=random.Random(3)
+    for i in range(200):
+        kind=i%4
+        if kind==0: p=b'{"gaze":{"x":%f,"y":%f,"timestamp":%d}}'%(rng.random(),rng.random(),i)
+        elif kind==1: p=os.urandom(rng.randrange(0,3000))
+        elif kind==2: p=b"short"
+        else: p=(b"word log entry %d; "%i)*rng.randrange(1,500)
+        compress = i%3!=0
+        if compress:
+            d=comp.compress(p)+comp.flush(zlib.Z_SYNC_FLUSH); assert d.endswith(b"\x00\x00\xff\xff")
+            send(s,0x80|0x40|2,d[:-4])
+        else: send(s,0x80|2,p)
+        b0,d=recv(s)
+        if b0&0x40:
+            if "server_no_context_takeover" in ext: dec=zlib.decompressobj(wbits=-15)
+            out=dec.decompress(d+b"\x00\x00\xff\xff")
+        else: out=d
+        check(out==p, f"roundtrip {i} len {len(p)} rsv1={b0&0x40}")
+        check((b0&0x40!=0)==(len(p)>=64), f"threshold {i}")
+    s.close()
+# fragmented compressed message
+s,ext=connect("permessage-deflate")
+p=b"fragmented "*1000; d=zlib.compressobj(wbits=-15); d=d.compress(p)+d.flush(zlib.Z_SYNC_FLUSH)
+send(s,0x40|1,d[:100]); send(s,0x00,d[100:-4][:50]); send(s,0x80,d[150:-4])
+b0,r=recv(s); check(zlib.decompressobj(wbits=-15).decompress(r+b"\x00\x00\xff\xff")==p,"fragmented")
+s.close()
+# invalid data -> 1007, rsv1 without extension -> 1002, bomb -> 1009
+for offer,payload,code in [("permessage-deflate",b"\xff\xff\xff\xff",1007),(None,b"abc",1002),
+                          ("permessage-deflate",zlib.compressobj(wbits=-15).compress(b"\0"*(4<<20)),1009)]:
+    s,ext=connect(offer)
+    if code==1009:
+        c=zlib.compressobj(wbits=-15); payload=c.compress(b"\0"*(4<<20))+c.flush(zlib.Z_SYNC_FLUSH); payload=payload[:-4]
+    send(s,0x80|0x40|1,payload)
+    b0,r=recv(s); check((b0&0xf)==8 and struct.unpack(">H",r[:2])[0]==code, f"close {code} got {r!r}")
+    s.close()
+print("fails",fails); sys.exit(1 if fails else 0)
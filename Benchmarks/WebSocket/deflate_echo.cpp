@@ -0,0 +1,25 @@
+// Echo server with permessage-deflate for deflate_client.py, which checks the negotiation, the round trips and the close codes.
+//   deflate_echo [port] & python3 deflate_client.py [port]
+#include "ws/server_ws.hpp"
+#include <cstdio>
+#include <cstdlib>
+
+using WsServer = SimpleWeb::SocketServer<SimpleWeb::WS>;
+
+int main(int argc, char **argv) {
+  WsServer server;
+  server.config.port = static_cast<unsigned short>(argc > 1 ? std::atoi(argv[1]) : 18182);
+  server.config.address = "127.0.0.1";
+  server.config.permessage_deflate.enabled = true;
+  server.config.permessage_deflate.compression_threshold = 64;
+  server.config.max_message_size = 1 << 20;
+  auto &echo = server.endpoint["^/echo/?$"];
+  echo.on_message = [](std::shared_ptr<WsServer::Connection> connection, std::shared_ptr<WsServer::InMessage> in_message) {
+    connection->send(in_message->string(), nullptr, in_message->fin_rsv_opcode);
+  };
+  echo.on_close = [](std::shared_ptr<WsServer::Connection>, int status, const std::string &reason) {
+    std::printf("closed %d %s\n", status, reason.c_str());
+    std::fflush(stdout);
+  };
+  server.start();
+}
@@ -0,0 +1,38 @@
+/* Counts the socket write calls of a process, printed when it exits.
+ *   LD_PRELOAD=./_bench/libsendmsg_count.so ./_bench/bench_broadcast */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+static atomic_long sendmsg_calls, send_calls, writev_calls;
+
+ssize_t sendmsg(int fd, const struct msghdr *message, int flags) {
+  static ssize_t (*next)(int, const struct msghdr *, int);
+  if(!next)
+    next = (ssize_t(*)(int, const struct msghdr *, int))dlsym(RTLD_NEXT, "sendmsg");
+  ++sendmsg_calls;
+  return next(fd, message, flags);
+}
+
+ssize_t send(int fd, const void *buffer, size_t size, int flags) {
+  static ssize_t (*next)(int, const void *, size_t, int);
+  if(!next)
+    next = (ssize_t(*)(int, const void *, size_t, int))dlsym(RTLD_NEXT, "send");
+  ++send_calls;
+  return next(fd, buffer, size, flags);
+}
+
+ssize_t writev(int fd, const struct iovec *buffers, int count) {
+  static ssize_t (*next)(int, const struct iovec *, int);
+  if(!next)
+    next = (ssize_t(*)(int, const struct iovec *, int))dlsym(RTLD_NEXT, "writev");
+  ++writev_calls;
+  return next(fd, buffers, count);
+}
+
+__attribute__((destructor)) static void print_counts(void) {
+  fprintf(stderr, "sendmsg %ld, send %ld, writev %ld\n", (long)sendmsg_calls, (long)send_calls, (long)writev_calls);
+}
@@ -7,13 +7,16 @@
 #include "Components/ArrowComponent.h"
 #include <AudioCaptureComponent.h>
 #include "Private/SubmixRecorder.h"
+#include "Private/GazeSampler.h"
 #include "SRanipal_API_Eye.h"
 #include "SRanipalEye_Core.h"
 #include "SRanipalEye_FunctionLibrary.h"
 #include "HeadMountedDisplayFunctionLibrary.h"
 #include "Stimulus.h"
 #include "XRMotionControllerBase.h"
-#include "Misc/Base64.h"
+#include "ws/base64.hpp"
+#include "Misc/CommandLine.h"
+#include "Misc/Parse.h"
 
 // Sets default values
 ABaseInformant::ABaseInformant()
@@ -87,27 +90,89 @@ void ABaseInformant::BeginPlay()
 	Recorder->SetNumChannels(1);
 
 	auto GM = GetWorld()->GetAuthGameMode<AReadingTrackerGameMode>();
+	if (!GM || !GM->IsReplaying())
+		GazeSource = CreateGazeSource();
 	if (GM)
 		GM->NotifyInformantSpawned(this);
 }
 
+TUniquePtr<IGazeSource> ABaseInformant::CreateGazeSource()
+{
+	//the command line lets CI and benchmark machines run without a headset
+	FString type;
+	if (FParse::Value(FCommandLine::Get(), TEXT("SciViGazeSource="), type))
+	{
+		const int64 value = StaticEnum<EGazeSource>()->GetValueByNameString(type);
+		if (value != INDEX_NONE)
+			GazeSourceType = (EGazeSource)value;
+		else
+			UE_LOG(LogTemp, Warning, TEXT("Gaze: unknown gaze source %s"), *type);
+	}
+	FParse::Value(FCommandLine::Get(), TEXT("SciViGazeSession="), GazeSessionDirectory);
+	FParse::Value(FCommandLine::Get(), TEXT("SciViGazeHz="), SyntheticGazeHz);
+
+	switch (GazeSourceType)
+	{
+	case EGazeSource::SessionLog:
+	{
+		auto source = MakeUnique<FSessionGazeSource>(GazeSessionDirectory);
+		if (!source->HasSamples())
+			return nullptr;
+		return MoveTemp(source);
+	}
+	case EGazeSource::Synthetic:
+	{
+		FSyntheticGazeParams params;
+		params.rate_hz = SyntheticGazeHz;
+		params.fixation_ms = SyntheticFixationMs;
+		params.saccade_deg = SyntheticSaccadeDeg;
+		params.blinks_per_minute = SyntheticBlinksPerMinute;
+		params.noise_deg = SyntheticNoiseDeg;
+		params.seed = SyntheticGazeSeed;
+		UE_LOG(LogTemp, Display, TEXT("Gaze: synthetic samples at %.0f Hz"), params.rate_hz);
+		return MakeUnique<FSyntheticGazeSource>(params);
+	}
+	default:
+		return MakeUnique<FGazeSampler>((uint32)FMath::Max(GazeRingCapacity, 2), GazePollIntervalMs);
+	}
+}
+
+void ABaseInformant::EndPlay(const EEndPlayReason::Type EndPlayReason)
+{
+	GazeSource.Reset();
+	Super::EndPlay(EndPlayReason);
+}
+
 // Called every frame
 void ABaseInformant::Tick(float DeltaTime)
 {
 	Super::Tick(DeltaTime);
 	auto GM = GetWorld()->GetAuthGameMode<AReadingTrackerGameMode>();
-	//collect gaze info
+	//every gaze sample since the last frame goes to the stimulus, not only the latest one
 	FGaze gaze;
-	FHitResult hitPoint(ForceInit);
-	GetGaze(gaze);
-	const float ray_length = 1000.0f;
-	EyeTrackingArrow->SetWorldLocationAndRotation(gaze.origin, gaze.direction.Rotation());
-	if (GM->RayTrace(this, gaze.origin, gaze.origin + gaze.direction * ray_length, hitPoint))
+	FGazeSample sample;
+	while (GazeSource && GazeSource->Pop(sample))
 	{
-		auto focusedStimulus = Cast<AStimulus>(hitPoint.Actor);
-		if (focusedStimulus)
-			focusedStimulus->OnInFocus(gaze, hitPoint);
+		//the eyes are closed or lost: the pupils are updated, the ray stays
+		if (!sample.valid)
+		{
+			sample.origin = LatestGazeSample.origin;
+			sample.direction = LatestGazeSample.direction;
+			sample.world_space = LatestGazeSample.world_space;
+		}
+		LatestGazeSample = sample;
+		GetGaze(gaze);
+		gaze.timestamp = sample.timestamp;
+		if (auto recorder = GM->GetSessionRecorder())
+			recorder->WriteGazeSample(sample, gaze.origin, gaze.direction);
+		if (sample.valid)
+			TraceGaze(gaze);
 	}
+	GetGaze(gaze);
+	EyeTrackingArrow->SetWorldLocationAndRotation(gaze.origin, gaze.direction.Rotation());
+	//the replay drives the controller visibility as it was recorded
+	if (GM->IsReplaying())
+		return;
 
 	//check if Right controller has moved
 	auto MC_Right_direction = MC_Right->GetComponentLocation() + MC_Right->GetForwardVector();
@@ -140,12 +205,20 @@ void ABaseInformant::Tick(float DeltaTime)
 	{
 		AudioSampleBuffer buffer;
 		Recorder->PopFirstRecordedBuffer(buffer);
-		auto b64pcm = FBase64::Encode((uint8_t*)buffer.RawPCMData, AudioSampleBuffer_MaxSamplesCount);
+		//the PCM is encoded right into the message after the data URL prefix
 		auto json = FString::Printf(TEXT("\"WAV\": {\"SampleRate\": %i,"
-				"\"PCM\": \"data:audio/wav;base64,%s\"}"),buffer.sample_rate, *b64pcm);
+				"\"PCM\": \"data:audio/wav;base64,"), buffer.sample_rate);
+		const int32 prefix_size = json.Len();
+		const int32 pcm_size = SimpleWeb::base64::encoded_size(AudioSampleBuffer_MaxSamplesCount);
+		auto& chars = json.GetCharArray();
+		chars.SetNumUninitialized(prefix_size + pcm_size + 3);
+		SimpleWeb::base64::encode((const unsigned char*)buffer.RawPCMData, AudioSampleBuffer_MaxSamplesCount, chars.GetData() + prefix_size);
+		chars[prefix_size + pcm_size] = TEXT('"');
+		chars[prefix_size + pcm_size + 1] = TEXT('}');
+		chars[prefix_size + pcm_size + 2] = TEXT('\0');
 		//if (GEngine)
 			//GEngine->AddOnScreenDebugMessage(rand(), 5, FColor::Green, json);
-		GM->Broadcast(json);
+		GM->Broadcast(json, EWSLane::Bulk, EWSMessageClass::Audio);
 	}
 }
 
@@ -164,20 +237,13 @@ void ABaseInformant::OnRTriggerPressed()
 	MC_Right_NoActionTime = 0.0f;
 	SetVisibility_MC_Right(true);
 
-	FGaze gaze;
-	GetGaze(gaze);
 	const float ray_length = 1000.0f;
 	auto GM = GetWorld()->GetAuthGameMode<AReadingTrackerGameMode>();
 	FVector trigger_ray = MC_Right->GetComponentLocation() +
 			MC_Right->GetForwardVector() * ray_length;
-	FHitResult hitPoint(ForceInit);
-	if (GM->RayTrace(this, MC_Right->GetComponentLocation(), trigger_ray, hitPoint))
-	{
-		auto triggeredStimulus = Cast<AStimulus>(hitPoint.Actor);
-		if (triggeredStimulus)
-			triggeredStimulus->OnTriggerPressed(hitPoint);		
-	}
-		
+	if (auto recorder = GM->GetSessionRecorder())
+		recorder->WriteTrigger(GetSessionTime(), true, MC_Right->GetComponentLocation(), trigger_ray);
+	TriggerStimulus(true, MC_Right->GetComponentLocation(), trigger_ray);
 
 	//start event of clicking
 	FKey LMB(TEXT("LeftMouseButton"));
@@ -186,23 +252,62 @@ void ABaseInformant::OnRTriggerPressed()
 
 void ABaseInformant::OnRTriggerReleased()
 {
-	FGaze gaze;
-	GetGaze(gaze);
 	const float ray_length = 1000.0f;
 	auto GM = GetWorld()->GetAuthGameMode<AReadingTrackerGameMode>();
 	FVector trigger_ray = MC_Right->GetComponentLocation() +
 		MC_Right->GetForwardVector() * ray_length;
+	if (auto recorder = GM->GetSessionRecorder())
+		recorder->WriteTrigger(GetSessionTime(), false, MC_Right->GetComponentLocation(), trigger_ray);
+	TriggerStimulus(false, MC_Right->GetComponentLocation(), trigger_ray);
+
+	//start event of clicking
+	FKey LMB(TEXT("LeftMouseButton"));
+	MC_Right_Interaction_Lazer->ReleasePointerKey(LMB);
+}
+
+void ABaseInformant::TriggerStimulus(bool pressed, const FVector& origin, const FVector& end)
+{
+	auto GM = GetWorld()->GetAuthGameMode<AReadingTrackerGameMode>();
 	FHitResult hitPoint(ForceInit);
-	if (GM->RayTrace(this, MC_Right->GetComponentLocation(), trigger_ray, hitPoint))
+	if (GM->RayTrace(this, origin, end, hitPoint))
 	{
 		auto triggeredStimulus = Cast<AStimulus>(hitPoint.Actor);
-		if (triggeredStimulus) 
-			triggeredStimulus->OnTriggerReleased(hitPoint);
+		if (triggeredStimulus)
+		{
+			if (pressed)
+				triggeredStimulus->OnTriggerPressed(hitPoint);
+			else
+				triggeredStimulus->OnTriggerReleased(hitPoint);
+		}
 	}
+}
 
-	//start event of clicking
-	FKey LMB(TEXT("LeftMouseButton"));
-	MC_Right_Interaction_Lazer->ReleasePointerKey(LMB);
+void ABaseInformant::TraceGaze(const FGaze& gaze)
+{
+	auto GM = GetWorld()->GetAuthGameMode<AReadingTrackerGameMode>();
+	const float ray_length = 1000.0f;
+	FHitResult hitPoint(ForceInit);
+	if (GM->RayTrace(this, gaze.origin, gaze.origin + gaze.direction * ray_length, hitPoint))
+	{
+		auto focusedStimulus = Cast<AStimulus>(hitPoint.Actor);
+		if (focusedStimulus)
+			focusedStimulus->OnInFocus(gaze, hitPoint);
+	}
+}
+
+void ABaseInformant::ReplayGaze(const FGaze& gaze, bool valid)
+{
+	//the messages the stimulus sends on its own (IMG_UP, R_RELD) get the replay clock, as they got the wall clock
+	ReplayedGaze = gaze;
+	ReplayedGaze->timestamp = 0.0;
+	if (valid)
+		TraceGaze(gaze);
+}
+
+void ABaseInformant::ReplayTrigger(bool pressed, const FVector& origin, const FVector& end)
+{
+	//the widgets aren't clicked, the controller isn't where it was recorded
+	TriggerStimulus(pressed, origin, end);
 }
 
 void ABaseInformant::CameraMove_LeftRight(float value)
@@ -219,6 +324,11 @@ void ABaseInformant::SetVisibility_MC_Right(bool visibility)
 {
 	if (IsValid(MC_Right)) 
 	{
+		//AOIs are only looked up while the controller is shown, the replay needs every change
+		auto GM = GetWorld() ? GetWorld()->GetAuthGameMode<AReadingTrackerGameMode>() : nullptr;
+		auto recorder = GM ? GM->GetSessionRecorder() : nullptr;
+		if (recorder && MC_Right->bHiddenInGame == visibility)
+			recorder->WriteControllerVisibility(GetSessionTime(), visibility);
 		MC_Right->SetHiddenInGame(!visibility, true);
 		MC_Right_Interaction_Lazer->bShowDebug = visibility;
 	}
@@ -235,16 +345,20 @@ void ABaseInformant::SetVisibility_MC_Left(bool visibility)
 
 void ABaseInformant::GetGaze(FGaze& gaze) const
 {
-	auto instance = SRanipalEye_Core::Instance();
-    ViveSR::anipal::Eye::VerboseData vd;
-    instance->GetVerboseData(vd);
-	instance->GetGazeRay(GazeIndex::COMBINE, gaze.origin, gaze.direction);
-	gaze.origin = CameraComponent->GetComponentTransform().TransformPosition(gaze.origin);
-	gaze.direction = CameraComponent->GetComponentTransform().TransformVector(gaze.direction);
-	gaze.left_pupil_diameter_mm = vd.left.pupil_diameter_mm;
-	gaze.left_pupil_openness = vd.left.eye_openness;
-	gaze.right_pupil_diameter_mm = vd.right.pupil_diameter_mm;
-	gaze.right_pupil_openness = vd.right.eye_openness;
+	if (ReplayedGaze.IsSet())
+	{
+		gaze = ReplayedGaze.GetValue();
+		return;
+	}
+	//the latest sample of the gaze source, the HMD pose is the current one
+	const FTransform& camera = CameraComponent->GetComponentTransform();
+	gaze.origin = LatestGazeSample.world_space ? LatestGazeSample.origin : camera.TransformPosition(LatestGazeSample.origin);
+	gaze.direction = LatestGazeSample.world_space ? LatestGazeSample.direction : camera.TransformVector(LatestGazeSample.direction);
+	gaze.left_pupil_diameter_mm = LatestGazeSample.left_pupil_diameter_mm;
+	gaze.left_pupil_openness = LatestGazeSample.left_pupil_openness;
+	gaze.right_pupil_diameter_mm = LatestGazeSample.right_pupil_diameter_mm;
+	gaze.right_pupil_openness = LatestGazeSample.right_pupil_openness;
+	gaze.timestamp = 0.0;
 	//here you can insert custom calibration
 }
 
@@ -7,6 +7,7 @@
 #include "Camera/CameraComponent.h"
 #include "MotionControllerComponent.h"
 #include "ReadingTracker.h"
+#include "Private/GazeSource.h"
 #include "BaseInformant.generated.h"
 
 struct FGaze
@@ -17,7 +18,16 @@ struct FGaze
 	float left_pupil_openness;
 	float right_pupil_diameter_mm;
 	float right_pupil_openness;
-	float cf;
+	float cf = 0.0f;
+	double timestamp = 0.0;//ms since the Unix epoch of the eye sample, 0 - now
+};
+
+UENUM(BlueprintType)
+enum class EGazeSource : uint8
+{
+	SRanipal,//eye tracker of the headset
+	SessionLog,//gaze samples of a recorded session, in a loop
+	Synthetic//generated fixations, saccades and blinks, no hardware needed
 };
 
 UCLASS()
@@ -30,6 +40,7 @@ public:
 	ABaseInformant();
 	// Called when the game starts or when spawned
 	virtual void BeginPlay() override;
+	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
 	// Called every frame
 	virtual void Tick(float DeltaTime) override;
 	// Called to bind functionality to input
@@ -40,6 +51,9 @@ public:
 	UFUNCTION(BlueprintCallable)
 	void SetVisibility_MC_Left(bool visibility);
 	void GetGaze(FGaze& gaze) const;
+	//session replay: the recorded world ray stands in for the eye tracker and the HMD
+	void ReplayGaze(const FGaze& gaze, bool valid);
+	void ReplayTrigger(bool pressed, const FVector& origin, const FVector& end);
 	UFUNCTION()
 	void StartRecording();
 	UFUNCTION()
@@ -65,6 +79,31 @@ public:
 	UPROPERTY(EditAnywhere, BlueprintReadonly)
 	class UWidgetInteractionComponent* MC_Right_Interaction_Lazer;
 
+	//gaze sampling thread: how often SRanipal is polled for a new sample and how many samples wait for the game thread
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Gaze)
+	float GazePollIntervalMs = 1.0f;
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Gaze)
+	int GazeRingCapacity = 1024;
+	//-SciViGazeSource=SRanipal|SessionLog|Synthetic overrides it
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Gaze)
+	EGazeSource GazeSourceType = EGazeSource::SRanipal;
+	//session directory for the SessionLog source, -SciViGazeSession=<directory> overrides it
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Gaze)
+	FString GazeSessionDirectory;
+	//Synthetic source, -SciViGazeHz= overrides the rate
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Gaze)
+	float SyntheticGazeHz = 250.0f;
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Gaze)
+	float SyntheticFixationMs = 250.0f;
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Gaze)
+	float SyntheticSaccadeDeg = 8.0f;
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Gaze)
+	float SyntheticBlinksPerMinute = 15.0f;
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Gaze)
+	float SyntheticNoiseDeg = 0.3f;
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Gaze)
+	int SyntheticGazeSeed = 1;
+
 	UPROPERTY(EditAnywhere, BlueprintReadonly)
 	class UAudioCaptureComponent* AudioCapture;
 	UPROPERTY(EditAnywhere, BlueprintReadonly)
@@ -84,6 +123,12 @@ protected:
 	static const constexpr float MCNoActionTimeout = 10.0f;
 	float MC_Left_NoActionTime = 0.0f;
 	float MC_Right_NoActionTime = 0.0f;
+	void TraceGaze(const FGaze& gaze);
+	void TriggerStimulus(bool pressed, const FVector& origin, const FVector& end);
+	TUniquePtr<IGazeSource> CreateGazeSource();
+	TUniquePtr<IGazeSource> GazeSource;
+	FGazeSample LatestGazeSample;//the ray of the last valid sample
+	TOptional<FGaze> ReplayedGaze;//returned by GetGaze while a session is replayed
 
 
 };
@@ -0,0 +1,45 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "AOIGridIndex.h"
+
+static const int32 AOIGridIndex_MaxCells = 64;
+
+void FAOIGridIndex::Reset()
+{
+    cells_x = cells_y = 0;
+    inv_cell_size = FVector2D::ZeroVector;
+    cell_start.Reset();
+    indices.Reset();
+}
+
+void FAOIGridIndex::Build(const TArray<FBox2D>& bboxes, const FVector2D& image_size)
+{
+    Reset();
+    if (bboxes.Num() == 0 || image_size.X < 1.0f || image_size.Y < 1.0f)
+        return;
+
+    //about one AOI per cell for evenly spread words
+    int32 cells = FMath::Clamp((int32)FMath::CeilToFloat(FMath::Sqrt((float)bboxes.Num())), 1, AOIGridIndex_MaxCells);
+    cells_x = cells_y = cells;
+    inv_cell_size = FVector2D(cells_x / image_size.X, cells_y / image_size.Y);
+
+    //counting pass, then the cells are filled in the AOI order
+    cell_start.SetNumZeroed(cells_x * cells_y + 1);
+    for (const auto& bbox : bboxes)
+        for (int32 y = CellY(bbox.Min.Y), y1 = CellY(bbox.Max.Y); y <= y1; ++y)
+            for (int32 x = CellX(bbox.Min.X), x1 = CellX(bbox.Max.X); x <= x1; ++x)
+                ++cell_start[y * cells_x + x + 1];
+    for (int32 i = 1; i < cell_start.Num(); ++i)
+        cell_start[i] += cell_start[i - 1];
+
+    indices.SetNumUninitialized(cell_start.Last());
+    TArray<int32> fill(cell_start.GetData(), cell_start.Num() - 1);
+    for (int32 i = 0; i < bboxes.Num(); ++i)
+    {
+        const auto& bbox = bboxes[i];
+        for (int32 y = CellY(bbox.Min.Y), y1 = CellY(bbox.Max.Y); y <= y1; ++y)
+            for (int32 x = CellX(bbox.Min.X), x1 = CellX(bbox.Max.X); x <= x1; ++x)
+                indices[fill[y * cells_x + x]++] = i;
+    }
+}
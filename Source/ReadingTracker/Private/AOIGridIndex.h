@@ -0,0 +1,33 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+//Uniform grid over the stimulus image: every cell lists the AOIs whose bbox overlaps it,
+//in ascending order, so the first AOI containing a point is the same as with a linear search.
+struct FAOIGridIndex
+{
+	void Build(const TArray<FBox2D>& bboxes, const FVector2D& image_size);
+	void Reset();
+	bool IsEmpty() const { return cells_x == 0; }
+
+	//AOIs that may contain the point, points outside of the image use the nearest border cell
+	TArrayView<const int32> Candidates(const FVector2D& pt) const
+	{
+		if (IsEmpty())
+			return TArrayView<const int32>();
+		int32 cell = CellY(pt.Y) * cells_x + CellX(pt.X);
+		return TArrayView<const int32>(indices.GetData() + cell_start[cell], cell_start[cell + 1] - cell_start[cell]);
+	}
+
+private:
+	int32 CellX(float x) const { return FMath::Clamp((int32)FMath::FloorToFloat(x * inv_cell_size.X), 0, cells_x - 1); }
+	int32 CellY(float y) const { return FMath::Clamp((int32)FMath::FloorToFloat(y * inv_cell_size.Y), 0, cells_y - 1); }
+
+	int32 cells_x = 0;
+	int32 cells_y = 0;
+	FVector2D inv_cell_size = FVector2D::ZeroVector;
+	TArray<int32> cell_start;//cells_x * cells_y + 1 offsets into indices
+	TArray<int32> indices;
+};
@@ -0,0 +1,21 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "AtlasPacker.h"
+
+bool FAtlasPacker::Add(const FIntPoint& size, FIntPoint& out_position)
+{
+    const int32 width = size.X + AOIAtlas_Padding;
+    const int32 height = size.Y + AOIAtlas_Padding;
+    if (shelf_x + width > AOIAtlas_PageSize)
+    {
+        shelf_y += shelf_height;
+        shelf_x = shelf_height = 0;
+    }
+    if (shelf_y + height > AOIAtlas_PageSize)
+        return false;
+    out_position = FIntPoint(shelf_x, shelf_y);
+    shelf_x += width;
+    shelf_height = FMath::Max(shelf_height, height);
+    return true;
+}
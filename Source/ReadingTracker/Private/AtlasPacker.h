@@ -0,0 +1,29 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+//size of the shared AOI thumbnail pages, AOIs larger than a page get a texture of their own
+static const int32 AOIAtlas_PageSize = 1024;
+//transparent gap between the thumbnails, so filtering doesn't bleed the neighbours in
+static const int32 AOIAtlas_Padding = 1;
+
+//Shelf packer filling one page at a time: rects go into a row until it's full, the next row starts below the tallest one.
+//Word AOIs have similar heights, so the rows are dense even though the rects come in any order.
+struct FAtlasPacker
+{
+	static bool FitsInPage(const FIntPoint& size)
+	{
+		return size.X + AOIAtlas_Padding <= AOIAtlas_PageSize && size.Y + AOIAtlas_Padding <= AOIAtlas_PageSize;
+	}
+	//position of the rect in the current page, false if the page is full
+	bool Add(const FIntPoint& size, FIntPoint& out_position);
+	//starts a new page
+	void Reset() { shelf_x = shelf_y = shelf_height = 0; }
+
+private:
+	int32 shelf_x = 0;
+	int32 shelf_y = 0;
+	int32 shelf_height = 0;
+};
@@ -0,0 +1,111 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "GazeSampler.h"
+#include "HAL/PlatformProcess.h"
+#include "SRanipal_API_Eye.h"
+#include "ReadingTracker.h"
+
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Gaze samples"), STAT_SciViGazeSamples, STATGROUP_SciVi);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Gaze samples dropped by the tracker"), STAT_SciViGazeDeviceDrops, STATGROUP_SciVi);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Gaze samples dropped by the ring"), STAT_SciViGazeRingDrops, STATGROUP_SciVi);
+
+FGazeSampler::FGazeSampler(uint32 ring_capacity, float poll_interval_ms)
+    : ring(ring_capacity), poll_interval_ms(poll_interval_ms)
+{
+    thread = FRunnableThread::Create(this, TEXT("SciViGazeSampler"), 0, TPri_AboveNormal);
+}
+
+FGazeSampler::~FGazeSampler()
+{
+    if (thread)
+    {
+        thread->Kill(true);
+        delete thread;
+    }
+}
+
+uint32 FGazeSampler::Run()
+{
+    statistics_time = FPlatformTime::Seconds();
+    while (!stopping)
+    {
+        Poll();
+        LogStatistics();
+        FPlatformProcess::SleepNoStats(poll_interval_ms / 1000.0f);
+    }
+    return 0;
+}
+
+static bool IsEyeDataValid(uint64 mask, ViveSR::anipal::Eye::SingleEyeDataValidity validity)
+{
+    return (mask & (1ull << (int)validity)) != 0;
+}
+
+void FGazeSampler::Poll()
+{
+    using namespace ViveSR::anipal::Eye;
+    //the tracker runs at its own rate, the same sample is returned until the next one is captured
+    EyeData data;
+    if (GetEyeData(&data) != ViveSR::Error::WORK)
+        return;
+    if (has_sequence && data.frame_sequence == last_sequence)
+    {
+        if (data.timestamp != last_device_timestamp)
+        {
+            ++out_of_order;
+            last_device_timestamp = data.timestamp;
+        }
+        return;
+    }
+    if (has_sequence && data.frame_sequence > last_sequence + 1)
+    {
+        device_drops += data.frame_sequence - last_sequence - 1;
+        INC_DWORD_STAT_BY(STAT_SciViGazeDeviceDrops, data.frame_sequence - last_sequence - 1);
+    }
+    else if (has_sequence && data.frame_sequence < last_sequence)
+        ++out_of_order;
+    has_sequence = true;
+    last_sequence = data.frame_sequence;
+    last_device_timestamp = data.timestamp;
+
+    FGazeSample sample;
+    sample.frame_sequence = data.frame_sequence;
+    sample.device_timestamp = data.timestamp;
+    FDateTime t = FDateTime::Now();
+    sample.timestamp = t.ToUnixTimestamp() * 1000.0 + t.GetMillisecond();
+    //combined ray, converted to the Unreal axes the way SRanipalEye_Core::GetGazeRay does
+    const SingleEyeData& combined = data.verbose_data.combined.eye_data;
+    sample.valid = IsEyeDataValid(combined.eye_data_validata_bit_mask, SingleEyeDataValidity::SINGLE_EYE_DATA_GAZE_ORIGIN_VALIDITY) &&
+                   IsEyeDataValid(combined.eye_data_validata_bit_mask, SingleEyeDataValidity::SINGLE_EYE_DATA_GAZE_DIRECTION_VALIDITY);
+    if (sample.valid)
+    {
+        sample.origin = FVector(combined.gaze_origin_mm.Z, -combined.gaze_origin_mm.X, combined.gaze_origin_mm.Y) * 0.1f;
+        sample.direction = FVector(combined.gaze_direction_normalized.Z, -combined.gaze_direction_normalized.X, combined.gaze_direction_normalized.Y);
+    }
+    sample.left_pupil_diameter_mm = data.verbose_data.left.pupil_diameter_mm;
+    sample.left_pupil_openness = data.verbose_data.left.eye_openness;
+    sample.right_pupil_diameter_mm = data.verbose_data.right.pupil_diameter_mm;
+    sample.right_pupil_openness = data.verbose_data.right.eye_openness;
+
+    ++samples;
+    INC_DWORD_STAT(STAT_SciViGazeSamples);
+    if (!ring.Enqueue(sample))
+    {
+        ++ring_drops;
+        INC_DWORD_STAT(STAT_SciViGazeRingDrops);
+    }
+}
+
+void FGazeSampler::LogStatistics()
+{
+    double now = FPlatformTime::Seconds();
+    if (now - statistics_time < 1.0)
+        return;
+    //quiet while nothing is lost
+    if (device_drops > 0 || out_of_order > 0 || ring_drops > 0)
+        UE_LOG(LogTemp, Warning, TEXT("Gaze: %.0f Hz, %u dropped by the tracker, %u out of order, %u dropped by the ring"),
+            samples / (now - statistics_time), device_drops, out_of_order, ring_drops);
+    statistics_time = now;
+    samples = device_drops = out_of_order = ring_drops = 0;
+}
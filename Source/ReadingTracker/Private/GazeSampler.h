@@ -0,0 +1,43 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "HAL/Runnable.h"
+#include "HAL/RunnableThread.h"
+#include "Containers/CircularQueue.h"
+#include "GazeSource.h"
+
+//SRanipal gaze source: pulls every eye sample of SRanipal on a thread of its own, so a frame hitch doesn't lose gaze samples.
+//New samples are detected by frame_sequence; the ones skipped by the device and the ones lost to a full ring are counted.
+class FGazeSampler : public FRunnable, public IGazeSource
+{
+public:
+	//ring_capacity samples are buffered for the game thread, rounded up to a power of two
+	FGazeSampler(uint32 ring_capacity, float poll_interval_ms);
+	virtual ~FGazeSampler();
+
+	virtual bool Pop(FGazeSample& out_sample) override { return ring.Dequeue(out_sample); }
+
+	virtual uint32 Run() override;
+	virtual void Stop() override { stopping = true; }
+
+private:
+	void Poll();
+	void LogStatistics();
+
+	TCircularQueue<FGazeSample> ring;
+	float poll_interval_ms;
+	TAtomic<bool> stopping{ false };
+	FRunnableThread* thread = nullptr;
+
+	//sampling thread only
+	bool has_sequence = false;
+	int32 last_sequence = 0;
+	int32 last_device_timestamp = 0;
+	uint32 samples = 0;
+	uint32 device_drops = 0;//gaps in frame_sequence
+	uint32 out_of_order = 0;//frame_sequence went back or repeated with another device timestamp, e.g. the tracker restarted
+	uint32 ring_drops = 0;//the game thread didn't keep up
+	double statistics_time = 0.0;
+};
@@ -0,0 +1,150 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "GazeSource.h"
+#include "SessionLog.h"
+
+//------------------------ Session log -----------------------
+
+FSessionGazeSource::FSessionGazeSource(const FString& directory)
+{
+    FSessionLogReader reader;
+    FSessionRecord record;
+    if (reader.Open(directory))
+    {
+        double first_time = 0.0;
+        while (reader.Next(record))
+        {
+            FSessionGazeSample recorded;
+            if (record.type != ESessionRecord::GazeSample || record.payload.Num() < sizeof(recorded))
+                continue;
+            FMemory::Memcpy(&recorded, record.payload.GetData(), sizeof(recorded));
+            if (samples.Num() == 0)
+                first_time = record.time;
+            FGazeSample& sample = samples.AddDefaulted_GetRef();
+            sample.frame_sequence = recorded.frame_sequence;
+            sample.device_timestamp = recorded.device_timestamp;
+            sample.timestamp = record.time - first_time;
+            sample.valid = recorded.valid != 0;
+            sample.world_space = true;
+            sample.origin = FVector(recorded.origin[0], recorded.origin[1], recorded.origin[2]);
+            sample.direction = FVector(recorded.direction[0], recorded.direction[1], recorded.direction[2]);
+            sample.left_pupil_diameter_mm = recorded.left_pupil_diameter_mm;
+            sample.left_pupil_openness = recorded.left_pupil_openness;
+            sample.right_pupil_diameter_mm = recorded.right_pupil_diameter_mm;
+            sample.right_pupil_openness = recorded.right_pupil_openness;
+        }
+    }
+    if (samples.Num() == 0)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Gaze: no gaze samples in the session %s"), *directory);
+        return;
+    }
+    //one mean sample interval between the last sample and the first one of the next loop
+    const double length_ms = samples.Last().timestamp;
+    loop_ms = length_ms + (samples.Num() > 1 ? length_ms / (samples.Num() - 1) : 1.0);
+    start_seconds = FPlatformTime::Seconds();
+    start_timestamp = GetSessionTime();
+    UE_LOG(LogTemp, Display, TEXT("Gaze: %d samples, %.1f s from the session %s"), samples.Num(), length_ms / 1000.0, *directory);
+}
+
+bool FSessionGazeSource::Pop(FGazeSample& out_sample)
+{
+    if (samples.Num() == 0)
+        return false;
+    const double due_ms = loop * loop_ms + samples[next].timestamp;
+    if (due_ms > (FPlatformTime::Seconds() - start_seconds) * 1000.0)
+        return false;
+    out_sample = samples[next];
+    out_sample.timestamp = start_timestamp + due_ms;
+    //the sequence goes on across the loops, so they don't look like dropped samples
+    out_sample.frame_sequence = loop * samples.Num() + next;
+    if (++next == samples.Num())
+    {
+        next = 0;
+        ++loop;
+    }
+    return true;
+}
+
+//------------------------ Synthetic -----------------------
+
+FSyntheticGazeSource::FSyntheticGazeSource(const FSyntheticGazeParams& params)
+    : params(params), period_ms(1000.0 / FMath::Max(params.rate_hz, 1.0f)), random(params.seed)
+{
+    start_seconds = FPlatformTime::Seconds();
+    start_timestamp = GetSessionTime();
+    fixation_end_ms = params.fixation_ms * random.FRandRange(0.5f, 1.5f);
+    if (params.blinks_per_minute > 0.0f)
+        next_blink_ms = -FMath::Loge(1.0f - random.GetFraction()) * 60000.0 / params.blinks_per_minute;
+    else
+        next_blink_ms = MAX_dbl;
+}
+
+bool FSyntheticGazeSource::Pop(FGazeSample& out_sample)
+{
+    if (index * period_ms > (FPlatformTime::Seconds() - start_seconds) * 1000.0)
+        return false;
+    Generate(out_sample);
+    return true;
+}
+
+float FSyntheticGazeSource::Gaussian()
+{
+    //Box-Muller
+    const float u = FMath::Max(random.GetFraction(), 1e-7f);
+    const float v = random.GetFraction();
+    return FMath::Sqrt(-2.0f * FMath::Loge(u)) * FMath::Cos(2.0f * PI * v);
+}
+
+void FSyntheticGazeSource::StartSaccade(double time)
+{
+    saccade_from = fixation;
+    //a random direction, the targets outside the field are mirrored back into it
+    const float amplitude = params.saccade_deg * random.FRandRange(0.5f, 1.5f);
+    const float angle = random.FRandRange(0.0f, 2.0f * PI);
+    FVector2D target = fixation + FVector2D(FMath::Cos(angle), FMath::Sin(angle)) * amplitude;
+    if (FMath::Abs(target.X) > params.field_deg)
+        target.X = fixation.X - (target.X - fixation.X);
+    if (FMath::Abs(target.Y) > params.field_deg)
+        target.Y = fixation.Y - (target.Y - fixation.Y);
+    fixation = FVector2D(FMath::Clamp(target.X, -params.field_deg, params.field_deg), FMath::Clamp(target.Y, -params.field_deg, params.field_deg));
+    //main sequence: 21 ms + 2.2 ms per degree
+    saccade_start_ms = time;
+    saccade_end_ms = time + 21.0 + 2.2 * FVector2D::Distance(saccade_from, fixation);
+    fixation_end_ms = saccade_end_ms + params.fixation_ms * random.FRandRange(0.5f, 1.5f);
+}
+
+void FSyntheticGazeSource::Generate(FGazeSample& out_sample)
+{
+    const double time = index * period_ms;
+    if (time >= fixation_end_ms)
+        StartSaccade(time);
+    FVector2D angles;
+    if (time < saccade_end_ms)
+    {
+        const float alpha = (float)((time - saccade_start_ms) / (saccade_end_ms - saccade_start_ms));
+        angles = FMath::Lerp(saccade_from, fixation, FMath::SmoothStep(0.0f, 1.0f, alpha));
+    }
+    else
+        angles = fixation + FVector2D(Gaussian(), Gaussian()) * params.noise_deg;
+    if (time >= next_blink_ms)
+    {
+        blink_end_ms = time + params.blink_ms;
+        next_blink_ms = time - FMath::Loge(1.0f - random.GetFraction()) * 60000.0 / params.blinks_per_minute;
+    }
+    const bool blink = time < blink_end_ms;
+
+    out_sample = FGazeSample();
+    out_sample.frame_sequence = index;
+    out_sample.device_timestamp = (int32)time;
+    out_sample.timestamp = start_timestamp + time;
+    out_sample.valid = !blink;
+    if (!blink)
+        out_sample.direction = FRotator(angles.Y, angles.X, 0.0f).Vector();
+    //the pupils drift slowly around 3.5 mm
+    const float pupil = 3.5f + 0.3f * FMath::Sin(2.0f * PI * (float)(time / 10000.0)) + 0.02f * Gaussian();
+    out_sample.left_pupil_diameter_mm = out_sample.right_pupil_diameter_mm = blink ? -1.0f : pupil;
+    out_sample.left_pupil_openness = out_sample.right_pupil_openness = blink ? 0.0f : 1.0f;
+    ++index;
+}
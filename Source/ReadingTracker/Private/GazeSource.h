@@ -0,0 +1,91 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Math/RandomStream.h"
+
+//Eye sample as the tracker produced it, in the HMD space with Unreal axes (cm)
+struct FGazeSample
+{
+	int32 frame_sequence = 0;//of the eye camera, consecutive samples differ by 1
+	int32 device_timestamp = 0;//ms, tracker clock
+	double timestamp = 0.0;//ms since the Unix epoch when the sample was picked up
+	bool valid = false;//false if the combined gaze ray wasn't tracked, origin and direction are zero then
+	bool world_space = false;//the ray is already in the world (cm), e.g. it comes from a recorded session
+	FVector origin = FVector::ZeroVector;
+	FVector direction = FVector::ZeroVector;
+	float left_pupil_diameter_mm = 0.0f;
+	float left_pupil_openness = 0.0f;
+	float right_pupil_diameter_mm = 0.0f;
+	float right_pupil_openness = 0.0f;
+};
+
+//Where the informant gets its gaze samples: the eye tracker (FGazeSampler), a recorded session or a generator.
+class IGazeSource
+{
+public:
+	virtual ~IGazeSource() {}
+	//the samples in order, false when there is no new one yet; single consumer: the game thread
+	virtual bool Pop(FGazeSample& out_sample) = 0;
+};
+
+//Plays the gaze samples of a recorded session (SessionLog.h) in real time and in a loop, the timestamps are shifted to now.
+//The rays are the recorded world rays, the HMD pose of the informant doesn't move them.
+class FSessionGazeSource : public IGazeSource
+{
+public:
+	explicit FSessionGazeSource(const FString& directory);
+	bool HasSamples() const { return samples.Num() > 0; }
+	virtual bool Pop(FGazeSample& out_sample) override;
+
+private:
+	TArray<FGazeSample> samples;//timestamp is ms from the first sample
+	double loop_ms = 0.0;
+	int32 next = 0;
+	int32 loop = 0;
+	double start_seconds = 0.0;
+	double start_timestamp = 0.0;
+};
+
+struct FSyntheticGazeParams
+{
+	float rate_hz = 250.0f;
+	float fixation_ms = 250.0f;//mean, the durations are spread by ±50%
+	float saccade_deg = 8.0f;//mean amplitude
+	float blinks_per_minute = 15.0f;
+	float blink_ms = 150.0f;
+	float noise_deg = 0.3f;//standard deviation of the fixational noise
+	float field_deg = 20.0f;//the fixations stay within this angle from straight ahead
+	int32 seed = 1;
+};
+
+//Generates fixations, saccades (main sequence duration, smooth velocity profile), blinks and noise at rate_hz,
+//so the informant pipeline runs without a headset. The same seed gives the same samples, only the timestamps differ.
+class FSyntheticGazeSource : public IGazeSource
+{
+public:
+	explicit FSyntheticGazeSource(const FSyntheticGazeParams& params);
+	//as many samples as the wall clock says were taken since the start
+	virtual bool Pop(FGazeSample& out_sample) override;
+	//the next sample regardless of the clock
+	void Generate(FGazeSample& out_sample);
+
+private:
+	void StartSaccade(double time);
+	float Gaussian();
+
+	FSyntheticGazeParams params;
+	double period_ms;
+	FRandomStream random;
+	int32 index = 0;
+	double start_seconds = 0.0;
+	double start_timestamp = 0.0;
+	FVector2D fixation = FVector2D::ZeroVector;//yaw, pitch (deg)
+	FVector2D saccade_from = FVector2D::ZeroVector;
+	double saccade_start_ms = 0.0;
+	double saccade_end_ms = 0.0;
+	double fixation_end_ms = 0.0;
+	double blink_end_ms = -1.0;
+	double next_blink_ms = 0.0;
+};
@@ -72,3 +72,12 @@ UTexture2D *URTHelpers::loadTexture2DFromFile(const FString &fullFilePath, ERTHe
     isValid = true;
     return loadedT2D;
 }
+
+void URTHelpers::updateTexture2DFromBGRA(UTexture2D *texture, const TArray<uint8> &bgra)
+{
+    void *textureData = texture->PlatformData->Mips[0].BulkData.Lock(LOCK_READ_WRITE);
+    FMemory::Memcpy(textureData, bgra.GetData(), bgra.Num());
+    texture->PlatformData->Mips[0].BulkData.Unlock();
+
+    texture->UpdateResource();
+}
@@ -26,4 +26,7 @@ class READINGTRACKER_API URTHelpers : public UBlueprintFunctionLibrary
 public:
     UFUNCTION(BlueprintPure, Category = "Helpers|Load Texture From File",meta=(Keywords="image png jpg jpeg bmp bitmap ico icon exr icns"))
     static UTexture2D *loadTexture2DFromFile(const FString &fullFilePath, ERTHelpersImageFormats imageFormat, bool &isValid, int32 &width, int32 &height);
+
+    //replaces the pixels of a transient BGRA texture of the same size
+    static void updateTexture2DFromBGRA(UTexture2D *texture, const TArray<uint8> &bgra);
 };
@@ -0,0 +1,373 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "SciViCommands.h"
+#include "Json.h"
+#include "Serialization/BufferReader.h"
+#include "ws/base64.hpp"
+
+static bool ParseAOI(const TSharedPtr<FJsonValue>& aoi_value, FSciViAOIDesc& aoi, FString& out_error)
+{
+    const TSharedPtr<FJsonObject>* aoi_object;
+    if (!aoi_value->TryGetObject(aoi_object))
+    {
+        out_error = TEXT("AOI isn't an object");
+        return false;
+    }
+    (*aoi_object)->TryGetStringField(TEXT("name"), aoi.name);
+    const TArray<TSharedPtr<FJsonValue>>* path;
+    if ((*aoi_object)->TryGetArrayField(TEXT("path"), path))
+    {
+        aoi.path.Reserve(path->Num());
+        for (auto& point_value : *path)
+        {
+            const TArray<TSharedPtr<FJsonValue>>* point;
+            double x, y;
+            if (!point_value->TryGetArray(point) || point->Num() < 2 ||
+                !(*point)[0]->TryGetNumber(x) || !(*point)[1]->TryGetNumber(y) ||
+                !FMath::IsFinite((float)x) || !FMath::IsFinite((float)y))
+            {
+                out_error = FString::Printf(TEXT("AOI %s: path point isn't [x, y]"), *aoi.name);
+                return false;
+            }
+            aoi.path.Add(FVector2D(x, y));
+        }
+    }
+    const TArray<TSharedPtr<FJsonValue>>* bbox;
+    double coords[4];
+    if (!(*aoi_object)->TryGetArrayField(TEXT("bbox"), bbox) || bbox->Num() < 4 ||
+        !(*bbox)[0]->TryGetNumber(coords[0]) || !(*bbox)[1]->TryGetNumber(coords[1]) ||
+        !(*bbox)[2]->TryGetNumber(coords[2]) || !(*bbox)[3]->TryGetNumber(coords[3]) ||
+        //1e999 parses as inf, 1e300 overflows the float, either would reach the float to int conversions of the AOI grid index
+        !FMath::IsFinite((float)coords[0]) || !FMath::IsFinite((float)coords[1]) ||
+        !FMath::IsFinite((float)coords[2]) || !FMath::IsFinite((float)coords[3]))
+    {
+        out_error = FString::Printf(TEXT("AOI %s: bbox isn't [x0, y0, x1, y1]"), *aoi.name);
+        return false;
+    }
+    aoi.bbox = FBox2D(FVector2D(coords[0], coords[1]), FVector2D(coords[2], coords[3]));
+    return true;
+}
+
+static bool ParseNewStimulus(const TSharedPtr<FJsonObject>& json, FSciViNewStimulusCommand& command, FString& out_error)
+{
+    FString image_textdata;
+    if (!json->TryGetStringField(TEXT("image"), image_textdata))
+    {
+        out_error = TEXT("unknown command");
+        return false;
+    }
+    static const FString png = TEXT("data:image/png;base64,");
+    static const FString jpg = TEXT("data:image/jpeg;base64,");
+    int startPos = 0;
+    if (image_textdata.StartsWith(png))
+    {
+        command.format = EImageFormat::PNG;
+        startPos = png.Len();
+    }
+    else if (image_textdata.StartsWith(jpg))
+    {
+        command.format = EImageFormat::JPEG;
+        startPos = jpg.Len();
+    }
+    else
+    {
+        out_error = TEXT("image isn't a PNG or JPEG data URL");
+        return false;
+    }
+    //decoded right after the prefix into the image buffer, no substring copy
+    const TCHAR* image_base64 = image_textdata.GetCharArray().GetData() + startPos;
+    const int32 image_base64_size = image_textdata.Len() - startPos;
+    size_t image_size;
+    command.image.SetNumUninitialized(SimpleWeb::base64::decoded_size(image_base64_size));
+    if (!SimpleWeb::base64::decode(image_base64, image_base64_size, command.image.GetData(), image_size))
+    {
+        out_error = TEXT("image isn't valid base64");
+        return false;
+    }
+    command.image.SetNum(image_size, false);
+    FSHA1::HashBuffer(command.image.GetData(), command.image.Num(), command.hash.Hash);
+    json->TryGetBoolField(TEXT("preload"), command.preload);
+
+    double sx = 1.0, sy = 1.0;
+    json->TryGetNumberField(TEXT("scaleX"), sx);
+    json->TryGetNumberField(TEXT("scaleY"), sy);
+    command.scale_x = (float)sx;
+    command.scale_y = (float)sy;
+
+    const TArray<TSharedPtr<FJsonValue>>* AOIs;
+    if (json->TryGetArrayField(TEXT("AOIs"), AOIs))
+    {
+        command.AOIs.SetNum(AOIs->Num());
+        for (int i = 0; i < AOIs->Num(); ++i)
+            if (!ParseAOI((*AOIs)[i], command.AOIs[i], out_error))
+                return false;
+    }
+    return true;
+}
+
+static bool IsHexString(const FString& text)
+{
+    for (TCHAR c : text)
+        if (!FChar::IsHexDigit(c))
+            return false;
+    return true;
+}
+
+bool ParseSciViCommand(const char* data, int32 size, FSciViCommand& out_command, FString& out_error)
+{
+    double start_time = FPlatformTime::Seconds();
+    FUTF8ToTCHAR json_text(data, size);
+    //the reader works on the converted text in place, a data URL stimulus isn't copied into an FString first
+    FBufferReader json_stream((void*)json_text.Get(), json_text.Length() * sizeof(TCHAR), false);
+    TSharedPtr<FJsonObject> json;
+    TSharedRef<TJsonReader<TCHAR>> jsonReader = TJsonReaderFactory<TCHAR>::Create(&json_stream);
+    if (!FJsonSerializer::Deserialize(jsonReader, json) || !json.IsValid())
+    {
+        out_error = TEXT("not a JSON object");
+        return false;
+    }
+
+    bool visibility;
+    FString speech, hash;
+    if (json->HasField(TEXT("calibrate")))
+        out_command.Emplace<FSciViCalibrateCommand>();
+    else if (json->HasField(TEXT("customCalibrate")))
+        out_command.Emplace<FSciViCustomCalibrateCommand>();
+    else if (json->HasField(TEXT("setMotionControllerVisibility")))
+    {
+        if (!json->TryGetBoolField(TEXT("setMotionControllerVisibility"), visibility))
+        {
+            out_error = TEXT("setMotionControllerVisibility isn't a bool");
+            return false;
+        }
+        out_command.Emplace<FSciViSetMCVisibilityCommand>(FSciViSetMCVisibilityCommand{ visibility });
+    }
+    else if (json->HasField(TEXT("Speech")))
+    {
+        if (!json->TryGetStringField(TEXT("Speech"), speech))
+        {
+            out_error = TEXT("Speech isn't a string");
+            return false;
+        }
+        out_command.Emplace<FSciViSpeechCommand>(FSciViSpeechCommand{ MoveTemp(speech) });
+    }
+    else if (json->TryGetStringField(TEXT("show"), hash))
+    {
+        FSciViShowCommand command;
+        if (hash.Len() != 40 || !IsHexString(hash))
+        {
+            out_error = TEXT("show needs the SHA1 of the image file, 40 hex digits");
+            return false;
+        }
+        HexToBytes(hash, command.hash.Hash);
+        out_command.Emplace<FSciViShowCommand>(command);
+    }
+    else
+    {
+        //everything else is a new stimulus, as before
+        FSciViNewStimulusCommand command;
+        if (!ParseNewStimulus(json, command, out_error))
+            return false;
+        command.parse_ms = (FPlatformTime::Seconds() - start_time) * 1000.0;
+        out_command.Emplace<FSciViNewStimulusCommand>(MoveTemp(command));
+    }
+    return true;
+}
+
+//bounds checked little-endian reads of the binary messages
+class FSciViBinaryReader
+{
+public:
+    FSciViBinaryReader(const uint8* data, int32 size) : data(data), size(size) {}
+    template <typename T>
+    bool Read(T& value)
+    {
+        if (size - offset < (int32)sizeof(T))
+            return false;
+        FMemory::Memcpy(&value, data + offset, sizeof(T));
+        offset += sizeof(T);
+        return true;
+    }
+    const uint8* Skip(int32 count)
+    {
+        if (count < 0 || size - offset < count)
+            return nullptr;
+        const uint8* start = data + offset;
+        offset += count;
+        return start;
+    }
+    int32 Remaining() const { return size - offset; }
+private:
+    const uint8* data;
+    int32 size;
+    int32 offset = 0;
+};
+
+static bool ParseBinaryStimulus(FSciViBinaryReader& reader, FSciViNewStimulusCommand& command, FString& out_error)
+{
+    uint8 version, format, reserved;
+    uint32 AOIs_count, image_size;
+    if (!reader.Read(version) || !reader.Read(format) || !reader.Read(reserved) ||
+        !reader.Read(command.scale_x) || !reader.Read(command.scale_y) ||
+        !reader.Read(AOIs_count) || !reader.Read(image_size))
+    {
+        out_error = TEXT("stimulus header is truncated");
+        return false;
+    }
+    if (version != 1)
+    {
+        out_error = FString::Printf(TEXT("stimulus version %d isn't supported"), version);
+        return false;
+    }
+    if (format == 1)
+        command.format = EImageFormat::PNG;
+    else if (format == 2)
+        command.format = EImageFormat::JPEG;
+    else
+    {
+        out_error = FString::Printf(TEXT("image format %d isn't PNG or JPEG"), format);
+        return false;
+    }
+    //every AOI takes at least its header, this also keeps a forged count from allocating too much
+    if (AOIs_count > (uint32)(reader.Remaining() / SciViStimulusAOIHeaderSize))
+    {
+        out_error = TEXT("AOI table is truncated");
+        return false;
+    }
+
+    command.AOIs.SetNum(AOIs_count);
+    for (auto& aoi : command.AOIs)
+    {
+        float bbox[4];
+        uint32 points_count;
+        uint16 name_size;
+        if (!reader.Read(bbox) || !reader.Read(points_count) || !reader.Read(name_size))
+        {
+            out_error = TEXT("AOI table is truncated");
+            return false;
+        }
+        //NaN and inf would reach the float to int conversions of the AOI grid index
+        if (!FMath::IsFinite(bbox[0]) || !FMath::IsFinite(bbox[1]) || !FMath::IsFinite(bbox[2]) || !FMath::IsFinite(bbox[3]))
+        {
+            out_error = TEXT("AOI bounding box isn't finite");
+            return false;
+        }
+        aoi.bbox = FBox2D(FVector2D(bbox[0], bbox[1]), FVector2D(bbox[2], bbox[3]));
+        const uint8* name = reader.Skip(name_size);
+        if (!name || points_count > (uint32)(reader.Remaining() / (2 * sizeof(float))))
+        {
+            out_error = TEXT("AOI table is truncated");
+            return false;
+        }
+        FUTF8ToTCHAR name_text((const ANSICHAR*)name, name_size);
+        aoi.name = FString(name_text.Length(), name_text.Get());
+        aoi.path.SetNumUninitialized(points_count);
+        for (auto& point : aoi.path)
+        {
+            float xy[2];
+            reader.Read(xy);
+            if (!FMath::IsFinite(xy[0]) || !FMath::IsFinite(xy[1]))
+            {
+                out_error = TEXT("AOI path point isn't finite");
+                return false;
+            }
+            point = FVector2D(xy[0], xy[1]);
+        }
+    }
+
+    const uint8* image = reader.Skip(image_size);
+    if (!image || image_size == 0)
+    {
+        out_error = TEXT("image is truncated");
+        return false;
+    }
+    command.image.Append(image, image_size);
+    FSHA1::HashBuffer(command.image.GetData(), command.image.Num(), command.hash.Hash);
+    return true;
+}
+
+bool ParseSciViBinaryCommand(const uint8* data, int32 size, FSciViCommand& out_command, FString& out_error)
+{
+    double start_time = FPlatformTime::Seconds();
+    FSciViBinaryReader reader(data, size);
+    uint8 type;
+    if (!reader.Read(type))
+    {
+        out_error = TEXT("empty binary message");
+        return false;
+    }
+    switch ((ESciViBinaryMessage)type)
+    {
+    case ESciViBinaryMessage::Stimulus:
+    case ESciViBinaryMessage::Preload:
+    {
+        FSciViNewStimulusCommand command;
+        command.preload = (ESciViBinaryMessage)type == ESciViBinaryMessage::Preload;
+        if (!ParseBinaryStimulus(reader, command, out_error))
+            return false;
+        command.parse_ms = (FPlatformTime::Seconds() - start_time) * 1000.0;
+        out_command.Emplace<FSciViNewStimulusCommand>(MoveTemp(command));
+        return true;
+    }
+    default:
+        out_error = FString::Printf(TEXT("unknown binary message type %d"), type);
+        return false;
+    }
+}
+
+int32 GetSciViBinaryStimulusSize(const FSciViNewStimulusCommand& command)
+{
+    int32 size = SciViStimulusHeaderSize + command.image.Num();
+    for (auto& aoi : command.AOIs)
+        size += SciViStimulusAOIHeaderSize + FTCHARToUTF8(*aoi.name).Length() + aoi.path.Num() * 2 * sizeof(float);
+    return size;
+}
+
+//little-endian writes of the binary messages, the buffer is sized by GetSciViBinaryStimulusSize
+class FSciViBinaryWriter
+{
+public:
+    FSciViBinaryWriter(uint8* data) : data(data) {}
+    template <typename T>
+    void Write(const T& value)
+    {
+        FMemory::Memcpy(data, &value, sizeof(T));
+        data += sizeof(T);
+    }
+    void Write(const void* bytes, int32 count)
+    {
+        FMemory::Memcpy(data, bytes, count);
+        data += count;
+    }
+private:
+    uint8* data;
+};
+
+void WriteSciViBinaryStimulus(const FSciViNewStimulusCommand& command, uint8* out)
+{
+    FSciViBinaryWriter writer(out);
+    writer.Write((uint8)(command.preload ? ESciViBinaryMessage::Preload : ESciViBinaryMessage::Stimulus));
+    writer.Write((uint8)1);
+    writer.Write((uint8)(command.format == EImageFormat::PNG ? 1 : 2));
+    writer.Write((uint8)0);
+    writer.Write(command.scale_x);
+    writer.Write(command.scale_y);
+    writer.Write((uint32)command.AOIs.Num());
+    writer.Write((uint32)command.image.Num());
+    for (auto& aoi : command.AOIs)
+    {
+        FTCHARToUTF8 name(*aoi.name);
+        float bbox[4] = { aoi.bbox.Min.X, aoi.bbox.Min.Y, aoi.bbox.Max.X, aoi.bbox.Max.Y };
+        writer.Write(bbox);
+        writer.Write((uint32)aoi.path.Num());
+        writer.Write((uint16)name.Length());
+        writer.Write(name.Get(), name.Length());
+        for (auto& point : aoi.path)
+        {
+            float xy[2] = { point.X, point.Y };
+            writer.Write(xy);
+        }
+    }
+    writer.Write(command.image.GetData(), command.image.Num());
+}
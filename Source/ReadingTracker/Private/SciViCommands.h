@@ -0,0 +1,94 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Misc/TVariant.h"
+#include "IImageWrapper.h"
+#include "Misc/SecureHash.h"
+
+//Commands received from SciVi. They are parsed and validated on the WebSocket threads,
+//the game thread only applies them.
+
+struct FSciViCalibrateCommand
+{
+};
+
+struct FSciViCustomCalibrateCommand
+{
+};
+
+struct FSciViSetMCVisibilityCommand
+{
+	bool visibility = false;
+};
+
+struct FSciViSpeechCommand
+{
+	FString text;
+};
+
+//AOI as SciVi sends it, the texture is cropped from the stimulus on the game thread
+struct FSciViAOIDesc
+{
+	FString name;
+	TArray<FVector2D> path;
+	FBox2D bbox = FBox2D(ForceInit);
+};
+
+struct FSciViNewStimulusCommand
+{
+	TArray<uint8> image;//compressed image, base64 is already decoded
+	EImageFormat format = EImageFormat::Invalid;
+	float scale_x = 1.0f;
+	float scale_y = 1.0f;
+	TArray<FSciViAOIDesc> AOIs;
+	FSHAHash hash;//SHA1 of the image file, the stimulus is cached under it
+	bool preload = false;//only cache the stimulus, it's shown later by FSciViShowCommand
+	double parse_ms = 0.0;//message parsing on the WebSocket thread
+};
+
+//show a stimulus sent before, {"show": "<SHA1 of the image file, 40 hex digits>"}
+struct FSciViShowCommand
+{
+	FSHAHash hash;
+};
+
+using FSciViCommand = TVariant<FEmptyVariantState, FSciViCalibrateCommand, FSciViCustomCalibrateCommand,
+	FSciViSetMCVisibilityCommand, FSciViSpeechCommand, FSciViNewStimulusCommand, FSciViShowCommand>;
+
+//parses a UTF-8 JSON message, returns false and the reason if it isn't a valid command
+bool ParseSciViCommand(const char* data, int32 size, FSciViCommand& out_command, FString& out_error);
+
+//Binary messages (opcode 130), little-endian, no padding. The first byte is the message type.
+enum class ESciViBinaryMessage : uint8
+{
+	Stimulus = 1,
+	Preload = 2//same layout as Stimulus
+};
+
+//Stimulus, version 1. Header (20 bytes):
+//   0 uint8    message type = 1 or 2
+//   1 uint8    version = 1
+//   2 uint8    image format: 1 - PNG, 2 - JPEG
+//   3 uint8    reserved, 0
+//   4 float32  scaleX
+//   8 float32  scaleY
+//  12 uint32   AOI count
+//  16 uint32   image size in bytes
+//then AOI count AOIs:
+//   0 float32  bbox[4]: min x, min y, max x, max y
+//  16 uint32   path point count
+//  20 uint16   name size in bytes
+//  22          name, UTF-8
+//   .          float32 path[point count][2]
+//then the PNG or JPEG file as is
+static const int32 SciViStimulusHeaderSize = 20;
+static const int32 SciViStimulusAOIHeaderSize = 22;
+
+//parses a binary message, returns false and the reason if it isn't a valid command
+bool ParseSciViBinaryCommand(const uint8* data, int32 size, FSciViCommand& out_command, FString& out_error);
+
+//size of the binary Stimulus (or Preload) message of the command and the message itself, the session log keeps stimuli in this form
+int32 GetSciViBinaryStimulusSize(const FSciViNewStimulusCommand& command);
+void WriteSciViBinaryStimulus(const FSciViNewStimulusCommand& command, uint8* out);
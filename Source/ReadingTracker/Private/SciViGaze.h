@@ -0,0 +1,62 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+
+//WebSocket subprotocol of the SciVi clients that get gaze samples as binary records (opcode 130) instead of JSON
+#define SCIVI_GAZE_SUBPROTOCOL "scivi-gaze.v1"
+
+enum class ESciViGazeAction : uint8
+{
+	LookAt = 0,//"LOOKAT"
+	Select = 1,//"SELECT"
+	RReld = 2,//"R_RELD"
+	ImgUp = 3//"IMG_UP"
+};
+
+inline const TCHAR* SciViGazeActionName(ESciViGazeAction action)
+{
+	switch (action)
+	{
+	case ESciViGazeAction::Select: return TEXT("SELECT");
+	case ESciViGazeAction::RReld: return TEXT("R_RELD");
+	case ESciViGazeAction::ImgUp: return TEXT("IMG_UP");
+	default: return TEXT("LOOKAT");
+	}
+}
+
+//Binary gaze record, little-endian, no padding. Version 1 layout (68 bytes):
+//   0 uint8    version = 1
+//   1 uint8    action code (ESciViGazeAction)
+//   2 uint16   record size in bytes, newer versions only append fields
+//   4 float64  timestamp, ms since the Unix epoch
+//  12 float32  uv[2]
+//  20 float32  origin[3]
+//  32 float32  direction[3]
+//  44 float32  left pupil diameter (mm), left pupil openness, right pupil diameter (mm), right pupil openness
+//  60 float32  cf
+//  64 int32    AOI index, -1 if the gaze is not on an AOI
+//With WSGazeBatchMs set, one message holds several LOOKAT records back to back, the size field of each gives the stride.
+#pragma pack(push, 1)
+struct FSciViGazeRecord
+{
+	uint8 version = 1;
+	uint8 action = 0;
+	uint16 size = 68;
+	double timestamp = 0.0;
+	float uv[2];
+	float origin[3];
+	float direction[3];
+	float left_pupil_diameter_mm;
+	float left_pupil_openness;
+	float right_pupil_diameter_mm;
+	float right_pupil_openness;
+	float cf;
+	int32 AOI_index;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(FSciViGazeRecord) == 68, "FSciViGazeRecord doesn't match the version 1 layout");
+//records are sent as they are in memory
+static_assert(PLATFORM_LITTLE_ENDIAN, "FSciViGazeRecord must be byte swapped on big-endian platforms");
@@ -0,0 +1,436 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "SessionLog.h"
+#include "HAL/FileManager.h"
+#include "Misc/FileHelper.h"
+#include "Misc/Paths.h"
+#include "Misc/Crc.h"
+
+#if PLATFORM_WINDOWS
+#include "Windows/AllowWindowsPlatformTypes.h"
+#include <windows.h>
+#include "Windows/HideWindowsPlatformTypes.h"
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const ANSICHAR SessionMagic[8] = { 'S', 'C', 'I', 'V', 'I', 'L', 'O', 'G' };
+static const uint32 SessionVersion = 1;
+//exists while a session is recorded, a session still having it at startup was cut short
+static const TCHAR* SessionRecordingMarker = TEXT("recording");
+static const TCHAR* SessionSegmentWildcard = TEXT("segment_*.rtlog");
+
+static double session_replay_time = 0.0;
+
+double GetSessionTime()
+{
+    if (session_replay_time > 0.0)
+        return session_replay_time;
+    FDateTime t = FDateTime::Now();
+    return t.ToUnixTimestamp() * 1000.0 + t.GetMillisecond();
+}
+
+void SetSessionReplayTime(double time)
+{
+    session_replay_time = time;
+}
+
+//preallocated file mapped for writing, it's cut to the written size when closed
+struct FSessionRecorder::FMappedSegment
+{
+    uint8* data = nullptr;
+    int64 size = 0;
+#if PLATFORM_WINDOWS
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#else
+    int file = -1;
+#endif
+
+    bool Open(const FString& path, int64 new_size)
+    {
+#if PLATFORM_WINDOWS
+        file = CreateFileW(*path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE)
+            return false;
+        //the mapping extends the file, the new bytes are zeros
+        mapping = CreateFileMappingW(file, nullptr, PAGE_READWRITE, (DWORD)(new_size >> 32), (DWORD)new_size, nullptr);
+        if (mapping)
+            data = static_cast<uint8*>(MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, (SIZE_T)new_size));
+#else
+        file = open(TCHAR_TO_UTF8(*path), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (file < 0)
+            return false;
+#if PLATFORM_LINUX
+        //the blocks are allocated now, a full disk fails here and not with SIGBUS on a write
+        bool allocated = posix_fallocate(file, 0, new_size) == 0;
+#else
+        bool allocated = ftruncate(file, new_size) == 0;
+#endif
+        if (allocated)
+        {
+            void* mapped = mmap(nullptr, new_size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+            data = mapped != MAP_FAILED ? static_cast<uint8*>(mapped) : nullptr;
+        }
+#endif
+        size = new_size;
+        if (!data)
+            Close(0);
+        return data != nullptr;
+    }
+
+    void Flush()
+    {
+        if (!data)
+            return;
+#if PLATFORM_WINDOWS
+        FlushViewOfFile(data, 0);
+#else
+        msync(data, size, MS_ASYNC);
+#endif
+    }
+
+    void Close(int64 used_size)
+    {
+#if PLATFORM_WINDOWS
+        if (data)
+            UnmapViewOfFile(data);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+        {
+            LARGE_INTEGER end;
+            end.QuadPart = used_size;
+            SetFilePointerEx(file, end, nullptr, FILE_BEGIN);
+            SetEndOfFile(file);
+            CloseHandle(file);
+        }
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (data)
+            munmap(data, size);
+        if (file >= 0)
+        {
+            ftruncate(file, used_size);
+            close(file);
+        }
+        file = -1;
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
+
+FSessionRecorder::FSessionRecorder() = default;
+
+FSessionRecorder::~FSessionRecorder()
+{
+    Close();
+}
+
+bool FSessionRecorder::Open(const FString& new_directory, int64 new_segment_size)
+{
+    Close();
+    directory = new_directory;
+    segment_size = FMath::Max<int64>(new_segment_size, 1024 * 1024);
+    segment_index = 0;
+    recorded_stimuli.Reset();
+    if (!IFileManager::Get().MakeDirectory(*directory, true) ||
+        !FFileHelper::SaveStringToFile(FString(), *(directory / SessionRecordingMarker)))
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Session log: can't create %s"), *directory);
+        return false;
+    }
+    if (!OpenSegment(segment_size))
+        return false;
+    UE_LOG(LogTemp, Display, TEXT("Session log: recording to %s"), *directory);
+    return true;
+}
+
+void FSessionRecorder::Close()
+{
+    if (!segment)
+        return;
+    CloseSegment();
+    IFileManager::Get().Delete(*(directory / SessionRecordingMarker));
+}
+
+bool FSessionRecorder::IsOpen() const
+{
+    return segment.IsValid();
+}
+
+void FSessionRecorder::Flush()
+{
+    if (segment)
+        segment->Flush();
+}
+
+bool FSessionRecorder::OpenSegment(int64 min_size)
+{
+    const FString path = directory / FString::Printf(TEXT("segment_%06u.rtlog"), segment_index);
+    segment = MakeUnique<FMappedSegment>();
+    if (!segment->Open(path, FMath::Max(segment_size, min_size)))
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Session log: can't map %s, the session isn't recorded anymore"), *path);
+        segment.Reset();
+        return false;
+    }
+    FMemory::Memcpy(segment->data, SessionMagic, sizeof(SessionMagic));
+    FMemory::Memcpy(segment->data + 8, &SessionVersion, sizeof(uint32));
+    FMemory::Memcpy(segment->data + 12, &segment_index, sizeof(uint32));
+    offset = SessionSegmentHeaderSize;
+    ++segment_index;
+    return true;
+}
+
+void FSessionRecorder::CloseSegment()
+{
+    segment->Close(offset);
+    segment.Reset();
+}
+
+uint8* FSessionRecorder::BeginRecord(uint32 payload_size)
+{
+    if (!segment)
+        return nullptr;
+    record_size = sizeof(FSessionRecordHeader) + payload_size;
+    const int64 padded_size = Align(record_size, 8);
+    //the next segment is at least as large as the record
+    if (offset + padded_size > segment->size)
+    {
+        CloseSegment();
+        if (!OpenSegment(SessionSegmentHeaderSize + padded_size))
+            return nullptr;
+    }
+    return segment->data + offset + sizeof(FSessionRecordHeader);
+}
+
+void FSessionRecorder::CommitRecord(ESessionRecord type, double time)
+{
+    uint8* record = segment->data + offset;
+    FSessionRecordHeader header;
+    header.time = time;
+    header.type = (uint16)type;
+    FMemory::Memcpy(record + 8, reinterpret_cast<const uint8*>(&header) + 8, sizeof(header) - 8);
+    const uint32 crc = FCrc::MemCrc32(record + 8, record_size - 8);
+    FMemory::Memcpy(record + 4, &crc, sizeof(crc));
+    //the size marks the record as complete
+    FPlatformMisc::MemoryBarrier();
+    FMemory::Memcpy(record, &record_size, sizeof(record_size));
+    offset += Align(record_size, 8);
+}
+
+void FSessionRecorder::Write(ESessionRecord type, double time, const void* payload, uint32 size)
+{
+    uint8* out = BeginRecord(size);
+    if (!out)
+        return;
+    FMemory::Memcpy(out, payload, size);
+    CommitRecord(type, time);
+}
+
+void FSessionRecorder::WriteGazeSample(const FGazeSample& sample, const FVector& origin, const FVector& direction)
+{
+    FSessionGazeSample record = {};
+    record.frame_sequence = sample.frame_sequence;
+    record.device_timestamp = sample.device_timestamp;
+    record.valid = sample.valid ? 1 : 0;
+    record.origin[0] = origin.X; record.origin[1] = origin.Y; record.origin[2] = origin.Z;
+    record.direction[0] = direction.X; record.direction[1] = direction.Y; record.direction[2] = direction.Z;
+    record.left_pupil_diameter_mm = sample.left_pupil_diameter_mm;
+    record.left_pupil_openness = sample.left_pupil_openness;
+    record.right_pupil_diameter_mm = sample.right_pupil_diameter_mm;
+    record.right_pupil_openness = sample.right_pupil_openness;
+    Write(ESessionRecord::GazeSample, sample.timestamp, &record, sizeof(record));
+}
+
+void FSessionRecorder::WriteGazeMessage(const FSciViGazeRecord& record)
+{
+    Write(ESessionRecord::GazeMessage, record.timestamp, &record, sizeof(record));
+}
+
+void FSessionRecorder::WriteTrigger(double time, bool pressed, const FVector& origin, const FVector& end)
+{
+    FSessionTrigger record = {};
+    record.pressed = pressed ? 1 : 0;
+    record.origin[0] = origin.X; record.origin[1] = origin.Y; record.origin[2] = origin.Z;
+    record.end[0] = end.X; record.end[1] = end.Y; record.end[2] = end.Z;
+    Write(ESessionRecord::Trigger, time, &record, sizeof(record));
+}
+
+void FSessionRecorder::WriteWallLog(double time, uint8 action, const FString& wall, const FString& AOI)
+{
+    FTCHARToUTF8 wall_name(*wall);
+    FTCHARToUTF8 AOI_name(*AOI);
+    const uint16 wall_size = (uint16)FMath::Min(wall_name.Length(), (int32)MAX_uint16);
+    const uint16 AOI_size = (uint16)FMath::Min(AOI_name.Length(), (int32)MAX_uint16);
+    uint8* out = BeginRecord(6 + wall_size + AOI_size);
+    if (!out)
+        return;
+    out[0] = action;
+    out[1] = 0;
+    FMemory::Memcpy(out + 2, &wall_size, sizeof(uint16));
+    FMemory::Memcpy(out + 4, &AOI_size, sizeof(uint16));
+    FMemory::Memcpy(out + 6, wall_name.Get(), wall_size);
+    FMemory::Memcpy(out + 6 + wall_size, AOI_name.Get(), AOI_size);
+    CommitRecord(ESessionRecord::WallLog, time);
+}
+
+void FSessionRecorder::WriteStimulus(double time, const FSciViNewStimulusCommand& command)
+{
+    if (!segment || recorded_stimuli.Contains(command.hash))
+        return;
+    uint8* out = BeginRecord(GetSciViBinaryStimulusSize(command));
+    if (!out)
+        return;
+    WriteSciViBinaryStimulus(command, out);
+    CommitRecord(ESessionRecord::Stimulus, time);
+    recorded_stimuli.Add(command.hash);
+}
+
+void FSessionRecorder::WriteStimulusShown(double time, const FSHAHash& hash, const FTransform& transform, const FVector2D& draw_size)
+{
+    FSessionStimulusShown record;
+    FMemory::Memcpy(record.hash, hash.Hash, sizeof(record.hash));
+    const FVector location = transform.GetLocation();
+    const FQuat rotation = transform.GetRotation();
+    const FVector scale = transform.GetScale3D();
+    record.location[0] = location.X; record.location[1] = location.Y; record.location[2] = location.Z;
+    record.rotation[0] = rotation.X; record.rotation[1] = rotation.Y; record.rotation[2] = rotation.Z; record.rotation[3] = rotation.W;
+    record.scale[0] = scale.X; record.scale[1] = scale.Y; record.scale[2] = scale.Z;
+    record.draw_size[0] = draw_size.X; record.draw_size[1] = draw_size.Y;
+    Write(ESessionRecord::StimulusShown, time, &record, sizeof(record));
+}
+
+void FSessionRecorder::WriteControllerVisibility(double time, bool visible)
+{
+    const uint8 record = visible ? 1 : 0;
+    Write(ESessionRecord::ControllerVisibility, time, &record, sizeof(record));
+}
+
+int64 GetSessionSegmentValidSize(const uint8* data, int64 size)
+{
+    uint32 version;
+    if (size < SessionSegmentHeaderSize || FMemory::Memcmp(data, SessionMagic, sizeof(SessionMagic)) != 0)
+        return 0;
+    FMemory::Memcpy(&version, data + 8, sizeof(version));
+    if (version != SessionVersion)
+        return 0;
+    int64 offset = SessionSegmentHeaderSize;
+    while (offset + (int64)sizeof(FSessionRecordHeader) <= size)
+    {
+        uint32 record_size, crc;
+        FMemory::Memcpy(&record_size, data + offset, sizeof(record_size));
+        FMemory::Memcpy(&crc, data + offset + 4, sizeof(crc));
+        if (record_size < sizeof(FSessionRecordHeader) || offset + record_size > size ||
+            FCrc::MemCrc32(data + offset + 8, record_size - 8) != crc)
+            break;
+        offset += Align(record_size, 8);
+    }
+    return FMath::Min(offset, size);
+}
+
+int32 RecoverSessionLogs(const FString& sessions_directory)
+{
+    TArray<FString> sessions;
+    IFileManager::Get().FindFiles(sessions, *(sessions_directory / TEXT("*")), false, true);
+    int32 recovered = 0;
+    for (auto& session : sessions)
+    {
+        const FString directory = sessions_directory / session;
+        const FString marker = directory / SessionRecordingMarker;
+        if (!IFileManager::Get().FileExists(*marker))
+            continue;
+        //the preallocated tail and a torn last record are cut off
+        TArray<FString> segments;
+        IFileManager::Get().FindFiles(segments, *(directory / SessionSegmentWildcard), true, false);
+        for (auto& name : segments)
+        {
+            const FString path = directory / name;
+            TArray<uint8> data;
+            if (!FFileHelper::LoadFileToArray(data, *path))
+                continue;
+            const int64 valid_size = GetSessionSegmentValidSize(data.GetData(), data.Num());
+            if (valid_size < data.Num())
+                FFileHelper::SaveArrayToFile(TArrayView<const uint8>(data.GetData(), (int32)valid_size), *path);
+        }
+        IFileManager::Get().Delete(*marker);
+        UE_LOG(LogTemp, Warning, TEXT("Session log: %s was cut short, recovered %d segments"), *directory, segments.Num());
+        ++recovered;
+    }
+    return recovered;
+}
+
+int32 PruneSessionLogs(const FString& sessions_directory, int32 keep)
+{
+    TArray<FString> sessions;
+    IFileManager::Get().FindFiles(sessions, *(sessions_directory / TEXT("*")), false, true);
+    //only the directories with segments are sessions, other directories there are left alone
+    sessions.RemoveAll([&sessions_directory](const FString& session)
+    {
+        TArray<FString> segments;
+        IFileManager::Get().FindFiles(segments, *(sessions_directory / session / SessionSegmentWildcard), true, false);
+        return segments.Num() == 0;
+    });
+    //the names are the start times, the oldest sort first
+    sessions.Sort();
+    int32 deleted = 0;
+    for (int32 i = 0; i < sessions.Num() - FMath::Max(keep, 0); ++i)
+    {
+        const FString directory = sessions_directory / sessions[i];
+        if (IFileManager::Get().DeleteDirectory(*directory, false, true))
+            ++deleted;
+        else
+            UE_LOG(LogTemp, Warning, TEXT("Session log: can't delete the old session %s"), *directory);
+    }
+    if (deleted > 0)
+        UE_LOG(LogTemp, Display, TEXT("Session log: %d old sessions deleted, %d kept"), deleted, sessions.Num() - deleted);
+    return deleted;
+}
+
+bool FSessionLogReader::Open(const FString& directory)
+{
+    segment_paths.Reset();
+    IFileManager::Get().FindFiles(segment_paths, *(directory / SessionSegmentWildcard), true, false);
+    //zero padded indices, the names sort in the segment order
+    segment_paths.Sort();
+    for (auto& path : segment_paths)
+        path = directory / path;
+    segment = INDEX_NONE;
+    offset = end = 0;
+    return segment_paths.Num() > 0;
+}
+
+bool FSessionLogReader::LoadSegment(int32 index)
+{
+    segment = index;
+    offset = end = 0;
+    if (!FFileHelper::LoadFileToArray(data, *segment_paths[index]))
+        return false;
+    //a log that wasn't recovered yet ends at its first broken record too
+    end = GetSessionSegmentValidSize(data.GetData(), data.Num());
+    offset = SessionSegmentHeaderSize;
+    return true;
+}
+
+bool FSessionLogReader::Next(FSessionRecord& out_record)
+{
+    while (segment == INDEX_NONE || offset >= end)
+    {
+        if (segment + 1 >= segment_paths.Num())
+            return false;
+        LoadSegment(segment + 1);
+    }
+    FSessionRecordHeader header;
+    FMemory::Memcpy(&header, data.GetData() + offset, sizeof(header));
+    out_record.type = (ESessionRecord)header.type;
+    out_record.time = header.time;
+    out_record.payload = TArrayView<const uint8>(data.GetData() + offset + sizeof(header), header.size - sizeof(header));
+    offset += Align(header.size, 8);
+    return true;
+}
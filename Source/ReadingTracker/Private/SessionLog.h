@@ -0,0 +1,161 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "GazeSource.h"
+#include "SciViGaze.h"
+#include "SciViCommands.h"
+
+//Session log: everything the informant does, so a session survives a SciVi disconnect and can be replayed.
+//A session is a directory of segments segment_000000.rtlog, segment_000001.rtlog, ... Little-endian, no padding.
+//Segment header (16 bytes):
+//   0 char[8]  "SCIVILOG"
+//   8 uint32   version = 1
+//  12 uint32   segment index
+//then records, each starts at a multiple of 8. Record header (24 bytes):
+//   0 uint32   record size in bytes with this header and without the padding, 0 - end of the segment
+//   4 uint32   CRC32 of bytes 8..size
+//   8 float64  time, ms since the Unix epoch
+//  16 uint16   record type (ESessionRecord)
+//  18 uint8[6] reserved, 0
+//  24          payload
+//Segments are preallocated and memory-mapped, so writing a record is a memcpy. The size is written last: after a crash
+//the log ends at the first record with a zero size or a wrong CRC, RecoverSessionLogs cuts the segments there.
+enum class ESessionRecord : uint16
+{
+	GazeSample = 1,//FSessionGazeSample, every sample of the gaze sampler
+	GazeMessage = 2,//FSciViGazeRecord as it was sent to SciVi: AOI hits and the actions
+	Trigger = 3,//FSessionTrigger
+	WallLog = 4,//uint8 EWallLogAction, uint8 reserved, uint16 wall name size, uint16 AOI name size, wall name, AOI name (UTF-8)
+	Stimulus = 5,//binary SciVi Stimulus or Preload message (SciViCommands.h), once per image in a session
+	StimulusShown = 6,//FSessionStimulusShown
+	ControllerVisibility = 7//uint8 1 - the right motion controller is shown and AOIs are looked up, 0 - hidden
+};
+
+#pragma pack(push, 1)
+struct FSessionRecordHeader
+{
+	uint32 size = 0;
+	uint32 crc = 0;
+	double time = 0.0;
+	uint16 type = 0;
+	uint8 reserved[6] = {};
+};
+
+//gaze ray in the world (cm), as the informant traced it
+struct FSessionGazeSample
+{
+	int32 frame_sequence;
+	int32 device_timestamp;
+	uint8 valid;
+	uint8 reserved[3];
+	float origin[3];
+	float direction[3];
+	float left_pupil_diameter_mm;
+	float left_pupil_openness;
+	float right_pupil_diameter_mm;
+	float right_pupil_openness;
+};
+
+//right trigger of the motion controller, the controller ray in the world (cm)
+struct FSessionTrigger
+{
+	uint8 pressed;
+	uint8 reserved[3];
+	float origin[3];
+	float end[3];
+};
+
+//stimulus shown to the informant and where its billboard is, so the gaze rays can be traced again
+struct FSessionStimulusShown
+{
+	uint8 hash[20];//SHA1 of the image file
+	float location[3];
+	float rotation[4];//quaternion X, Y, Z, W
+	float scale[3];
+	float draw_size[2];
+};
+#pragma pack(pop)
+
+static const int32 SessionSegmentHeaderSize = 16;
+
+//ms since the Unix epoch, the clock of the gaze samples and of the SciVi messages; the time of the record being replayed in a replay
+double GetSessionTime();
+//0 - back to the wall clock
+void SetSessionReplayTime(double time);
+static_assert(sizeof(FSessionRecordHeader) == 24, "FSessionRecordHeader doesn't match the version 1 layout");
+
+//Appends records to the segments of one session. Game thread only.
+class FSessionRecorder
+{
+public:
+	FSessionRecorder();
+	~FSessionRecorder();
+	//creates the session directory and its first segment
+	bool Open(const FString& directory, int64 segment_size);
+	//the last segment is cut to its records
+	void Close();
+	bool IsOpen() const;
+	//starts writing the dirty pages to the disk, without waiting
+	void Flush();
+
+	void Write(ESessionRecord type, double time, const void* payload, uint32 size);
+	void WriteGazeSample(const FGazeSample& sample, const FVector& origin, const FVector& direction);
+	void WriteGazeMessage(const FSciViGazeRecord& record);
+	void WriteTrigger(double time, bool pressed, const FVector& origin, const FVector& end);
+	void WriteWallLog(double time, uint8 action, const FString& wall, const FString& AOI);
+	//the image is stored the first time its hash is seen in the session
+	void WriteStimulus(double time, const FSciViNewStimulusCommand& command);
+	void WriteStimulusShown(double time, const FSHAHash& hash, const FTransform& transform, const FVector2D& draw_size);
+	void WriteControllerVisibility(double time, bool visible);
+
+	const FString& GetDirectory() const { return directory; }
+
+private:
+	//pointer to the payload of a new record in the mapped segment, nullptr if the log isn't open
+	uint8* BeginRecord(uint32 payload_size);
+	void CommitRecord(ESessionRecord type, double time);
+	bool OpenSegment(int64 min_size);
+	void CloseSegment();
+
+	struct FMappedSegment;
+	TUniquePtr<FMappedSegment> segment;
+	FString directory;
+	int64 segment_size = 0;
+	uint32 segment_index = 0;
+	int64 offset = 0;//of the record being written in the segment
+	uint32 record_size = 0;
+	TSet<FSHAHash> recorded_stimuli;
+};
+
+struct FSessionRecord
+{
+	ESessionRecord type;
+	double time;
+	TArrayView<const uint8> payload;
+};
+
+//Reads the records of a session in order, a segment at a time.
+class FSessionLogReader
+{
+public:
+	bool Open(const FString& directory);
+	//false at the end of the log, the payload is valid until the next call
+	bool Next(FSessionRecord& out_record);
+
+private:
+	bool LoadSegment(int32 index);
+	TArray<FString> segment_paths;
+	int32 segment = INDEX_NONE;
+	TArray<uint8> data;
+	int64 offset = 0;
+	int64 end = 0;
+};
+
+//size of the segment up to the end of its last intact record
+int64 GetSessionSegmentValidSize(const uint8* data, int64 size);
+//cuts the segments of the sessions in the directory left by a crash, returns the number of recovered sessions
+int32 RecoverSessionLogs(const FString& sessions_directory);
+//deletes the oldest sessions in the directory but the newest keep ones, returns the number of deleted sessions
+int32 PruneSessionLogs(const FString& sessions_directory, int32 keep);
@@ -0,0 +1,76 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "StimulusPipeline.h"
+#include "Async/Async.h"
+#include "IImageWrapperModule.h"
+#include "ReadingTracker.h"
+
+DECLARE_CYCLE_STAT(TEXT("Stimulus decode"), STAT_SciViStimulusDecode, STATGROUP_SciVi);
+DECLARE_CYCLE_STAT(TEXT("Stimulus AOI index"), STAT_SciViStimulusIndex, STATGROUP_SciVi);
+
+static bool DecodeStimulus(IImageWrapperModule& imageWrapperModule, const FSciViNewStimulusCommand& command, FPreparedStimulus& stimulus)
+{
+    SCOPE_CYCLE_COUNTER(STAT_SciViStimulusDecode);
+    TSharedPtr<IImageWrapper> imageWrapper = imageWrapperModule.CreateImageWrapper(command.format);
+    if (!imageWrapper.IsValid() || !imageWrapper->SetCompressed(command.image.GetData(), command.image.Num()))
+    {
+        stimulus.error = TEXT("image can't be decompressed");
+        return false;
+    }
+    if (!imageWrapper->GetRaw(ERGBFormat::BGRA, 8, stimulus.bgra))
+    {
+        stimulus.error = TEXT("image can't be converted to BGRA");
+        return false;
+    }
+    stimulus.width = imageWrapper->GetWidth();
+    stimulus.height = imageWrapper->GetHeight();
+    if (stimulus.width <= 0 || stimulus.height <= 0)
+    {
+        stimulus.error = TEXT("image is empty");
+        return false;
+    }
+    return true;
+}
+
+static void BuildAOIIndex(FPreparedStimulus& stimulus)
+{
+    SCOPE_CYCLE_COUNTER(STAT_SciViStimulusIndex);
+    TArray<FBox2D> bboxes;
+    bboxes.Reserve(stimulus.AOIs.Num());
+    for (const auto& aoi : stimulus.AOIs)
+        bboxes.Add(aoi.bbox);
+    stimulus.index.Build(bboxes, FVector2D(stimulus.width, stimulus.height));
+}
+
+TFuture<TUniquePtr<FPreparedStimulus>> PrepareStimulusAsync(FSciViNewStimulusCommand&& command)
+{
+    //modules can only be loaded on the game thread, the image wrappers themselves work on any thread
+    IImageWrapperModule& imageWrapperModule = FModuleManager::LoadModuleChecked<IImageWrapperModule>(FName("ImageWrapper"));
+    double start_time = FPlatformTime::Seconds();
+    return Async(EAsyncExecution::ThreadPool, [&imageWrapperModule, start_time, command = MoveTemp(command)]() mutable
+    {
+        auto stimulus = MakeUnique<FPreparedStimulus>();
+        stimulus->start_time = start_time;
+        stimulus->scale_x = command.scale_x;
+        stimulus->scale_y = command.scale_y;
+        stimulus->parse_ms = command.parse_ms;
+        stimulus->hash = command.hash;
+        stimulus->preload = command.preload;
+
+        double stage_start = FPlatformTime::Seconds();
+        if (!DecodeStimulus(imageWrapperModule, command, *stimulus))
+            return stimulus;
+        command.image.Empty();
+        double now = FPlatformTime::Seconds();
+        stimulus->decode_ms = (now - stage_start) * 1000.0;
+
+        stage_start = now;
+        stimulus->AOIs = MoveTemp(command.AOIs);
+        BuildAOIIndex(*stimulus);
+        stimulus->index_ms = (FPlatformTime::Seconds() - stage_start) * 1000.0;
+
+        stimulus->valid = true;
+        return stimulus;
+    });
+}
@@ -0,0 +1,33 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "Async/Future.h"
+#include "SciViCommands.h"
+#include "AOIGridIndex.h"
+
+//Stimulus prepared on the worker threads, the game thread only creates the textures from it
+struct FPreparedStimulus
+{
+	bool valid = false;
+	FString error;
+	int32 width = 0;
+	int32 height = 0;
+	TArray<uint8> bgra;//kept on the CPU for the AOI thumbnails
+	float scale_x = 1.0f;
+	float scale_y = 1.0f;
+	TArray<FSciViAOIDesc> AOIs;
+	FAOIGridIndex index;
+	FSHAHash hash;
+	bool preload = false;
+
+	//stage timings, ms
+	double parse_ms = 0.0;
+	double decode_ms = 0.0;
+	double index_ms = 0.0;
+	double start_time = 0.0;//FPlatformTime::Seconds() when the command was handed to the pipeline
+};
+
+//decode -> BGRA -> AOI index on the thread pool, must be called on the game thread
+TFuture<TUniquePtr<FPreparedStimulus>> PrepareStimulusAsync(FSciViNewStimulusCommand&& command);
@@ -0,0 +1,88 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+
+#include "TexturePool.h"
+#include "Engine/Texture2D.h"
+#include "ReadingTracker.h"
+
+DECLARE_MEMORY_STAT(TEXT("Stimulus textures in use"), STAT_SciViTexturesUsed, STATGROUP_SciVi);
+DECLARE_MEMORY_STAT(TEXT("Stimulus textures free"), STAT_SciViTexturesFree, STATGROUP_SciVi);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Stimulus textures reused"), STAT_SciViTexturesReused, STATGROUP_SciVi);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Stimulus textures created"), STAT_SciViTexturesCreated, STATGROUP_SciVi);
+
+SIZE_T FStimulusTexturePool::TextureBytes(int32 width, int32 height, EPixelFormat format)
+{
+    return (SIZE_T)width * height * GPixelFormats[format].BlockBytes;
+}
+
+SIZE_T FStimulusTexturePool::TextureBytes(const UTexture2D* texture)
+{
+    return TextureBytes(texture->GetSizeX(), texture->GetSizeY(), texture->GetPixelFormat());
+}
+
+UTexture2D* FStimulusTexturePool::Acquire(int32 width, int32 height, EPixelFormat format)
+{
+    int index = free.IndexOfByPredicate([width, height, format](const UTexture2D* texture)
+    {
+        return texture->GetSizeX() == width && texture->GetSizeY() == height && texture->GetPixelFormat() == format;
+    });
+    UTexture2D* texture = nullptr;
+    const SIZE_T bytes = TextureBytes(width, height, format);
+    if (index != INDEX_NONE)
+    {
+        texture = free[index];
+        free.RemoveAt(index, 1, false);
+        free_bytes -= bytes;
+        DEC_MEMORY_STAT_BY(STAT_SciViTexturesFree, bytes);
+        INC_DWORD_STAT(STAT_SciViTexturesReused);
+    }
+    else
+    {
+        texture = UTexture2D::CreateTransient(width, height, format);
+        if (!texture)
+            return nullptr;
+        INC_DWORD_STAT(STAT_SciViTexturesCreated);
+    }
+    used.Add(texture);
+    used_bytes += bytes;
+    INC_MEMORY_STAT_BY(STAT_SciViTexturesUsed, bytes);
+    Trim();
+    return texture;
+}
+
+void FStimulusTexturePool::Release(UTexture2D* texture)
+{
+    if (!texture || used.RemoveSingleSwap(texture, false) == 0)
+        return;
+    const SIZE_T bytes = TextureBytes(texture);
+    used_bytes -= bytes;
+    DEC_MEMORY_STAT_BY(STAT_SciViTexturesUsed, bytes);
+    free.Add(texture);
+    free_bytes += bytes;
+    INC_MEMORY_STAT_BY(STAT_SciViTexturesFree, bytes);
+    Trim();
+}
+
+bool FStimulusTexturePool::Trim()
+{
+    while (memory_ceiling > 0 && GetLiveBytes() > memory_ceiling && free.Num() > 0)
+    {
+        //not referenced by anything else, the garbage collector destroys it
+        const SIZE_T bytes = TextureBytes(free[0]);
+        free.RemoveAt(0, 1, false);
+        free_bytes -= bytes;
+        DEC_MEMORY_STAT_BY(STAT_SciViTexturesFree, bytes);
+    }
+    return memory_ceiling == 0 || used_bytes <= memory_ceiling;
+}
+
+bool FStimulusTexturePool::WouldExceed(int32 width, int32 height, EPixelFormat format) const
+{
+    return memory_ceiling > 0 && used_bytes + TextureBytes(width, height, format) > memory_ceiling;
+}
+
+void FStimulusTexturePool::AddReferencedObjects(FReferenceCollector& Collector)
+{
+    Collector.AddReferencedObjects(used);
+    Collector.AddReferencedObjects(free);
+}
@@ -0,0 +1,38 @@
+// Fill out your copyright notice in the Description page of Project Settings.
+
+#pragma once
+
+#include "CoreMinimal.h"
+#include "UObject/GCObject.h"
+
+class UTexture2D;
+
+//Transient textures of the stimuli. The pool keeps them alive instead of AddToRoot: a released texture waits
+//for a request of the same size and format, and is left to the garbage collector when the pool is over its ceiling.
+class FStimulusTexturePool : public FGCObject
+{
+public:
+	//reused or new texture, its content is undefined
+	UTexture2D* Acquire(int32 width, int32 height, EPixelFormat format = PF_B8G8R8A8);
+	void Release(UTexture2D* texture);
+
+	//drops the free textures while the pool is above the ceiling, returns false if the textures in use are above it alone
+	bool Trim();
+	//true if a new texture of this size can't be created without going above the ceiling
+	bool WouldExceed(int32 width, int32 height, EPixelFormat format = PF_B8G8R8A8) const;
+	SIZE_T memory_ceiling = 0;//bytes, 0 - no ceiling
+
+	SIZE_T GetLiveBytes() const { return used_bytes + free_bytes; }
+	SIZE_T GetUsedBytes() const { return used_bytes; }
+
+	virtual void AddReferencedObjects(FReferenceCollector& Collector) override;
+	virtual FString GetReferencerName() const override { return TEXT("FStimulusTexturePool"); }
+
+private:
+	static SIZE_T TextureBytes(int32 width, int32 height, EPixelFormat format);
+	static SIZE_T TextureBytes(const UTexture2D* texture);
+	TArray<UTexture2D*> used;
+	TArray<UTexture2D*> free;//the least recently released first
+	SIZE_T used_bytes = 0;
+	SIZE_T free_bytes = 0;
+};
@@ -1,5 +1,6 @@
 // Fill out your copyright notice in the Description page of Project Settings.
 
+using System;
 using UnrealBuildTool;
 
 public class ReadingTracker : ModuleRules
@@ -13,6 +14,18 @@ public class ReadingTracker : ModuleRules
 
 		PrivateDependencyModuleNames.AddRange(new string[] { "OpenSSL",  "Json", "JsonUtilities", "HeadMountedDisplay", "SignalProcessing", "AudioCapture" });
 		
+		//zlib is used by the WebSocket server for permessage-deflate
+		AddEngineThirdPartyPrivateStaticDependencies(Target, "zlib");
+
+		//io_uring backend for the WebSocket server on Linux: set READINGTRACKER_IO_URING=1 when generating the project files.
+		//Needs asio 1.21 or newer in ThirdPartyLibs/asio and liburing, asio_compatibility.hpp stops the build otherwise.
+		if (Target.Platform == UnrealTargetPlatform.Linux && Environment.GetEnvironmentVariable("READINGTRACKER_IO_URING") == "1")
+		{
+			PrivateDefinitions.Add("ASIO_HAS_IO_URING=1");
+			PrivateDefinitions.Add("ASIO_DISABLE_EPOLL=1");//sockets use io_uring too, not only files
+			PublicSystemLibraries.Add("uring");
+		}
+
 		PrivateIncludePaths.AddRange(new string[] {
 			"ThirdPartyLibs",
 			"../Plugins/SRanipal/Source/SRanipal/Public/Eye"
@@ -3,7 +3,10 @@
 #pragma once
 
 #include "CoreMinimal.h"
+#include "Stats/Stats.h"
 #include <StaticSampleBuffer.h>
 
 static const int AudioSampleBuffer_MaxSamplesCount = 2048;
-using AudioSampleBuffer = Audio::FStaticSampleBuffer<int16, AudioSampleBuffer_MaxSamplesCount>;
\ No newline at end of file
+using AudioSampleBuffer = Audio::FStaticSampleBuffer<int16, AudioSampleBuffer_MaxSamplesCount>;
+
+DECLARE_STATS_GROUP(TEXT("SciVi"), STATGROUP_SciVi, STATCAT_Advanced);
@@ -5,47 +5,22 @@
 #include "Stimulus.h"
 #include "BaseInformant.h"
 #include "Private/UI_Blank.h"
+#include "Private/RTHelpers.h"
 #include "Components/Button.h"
 #include "Components/EditableText.h"
+#include "Components/WidgetComponent.h"
+#include "Misc/Paths.h"
+#include "Misc/App.h"
+#include "Misc/CommandLine.h"
+#include "Misc/Parse.h"
+#include "HAL/FileManager.h"
 #include "WordListWall.h"
 #include "ImageUtils.h"
 #include "IImageWrapper.h"
 #include "IImageWrapperModule.h"
-#include "Json.h"
-#include "Misc/Base64.h"
 #include "SRanipalEye_Framework.h"
 #include "SRanipal_API_Eye.h"
 
-UTexture2D* loadTexture2DFromBytes(const TArray<uint8>& bytes, EImageFormat fmt)
-{
-    UTexture2D* loadedT2D = nullptr;
-
-    IImageWrapperModule& imageWrapperModule = FModuleManager::LoadModuleChecked<IImageWrapperModule>(FName("ImageWrapper"));
-    TSharedPtr<IImageWrapper> imageWrapper = imageWrapperModule.CreateImageWrapper(fmt);
-
-    if (imageWrapper.IsValid() && imageWrapper->SetCompressed(bytes.GetData(), bytes.Num()))
-    {
-        TArray<uint8> uncompressedBGRA;
-        if (imageWrapper->GetRaw(ERGBFormat::BGRA, 8, uncompressedBGRA))
-        {
-            int w = imageWrapper->GetWidth();
-            int h = imageWrapper->GetHeight();
-            loadedT2D = UTexture2D::CreateTransient(w, h);
-            loadedT2D->AddToRoot();
-            if (!loadedT2D)
-                return nullptr;
-
-            void* textureData = loadedT2D->PlatformData->Mips[0].BulkData.Lock(LOCK_READ_WRITE);
-            FMemory::Memcpy(textureData, uncompressedBGRA.GetData(), uncompressedBGRA.Num());
-            loadedT2D->PlatformData->Mips[0].BulkData.Unlock();
-
-            loadedT2D->UpdateResource();
-        }
-    }
-
-    return loadedT2D;
-}
-
 UTexture2D* loadTexture2DFromFile(const FString& fullFilePath)
 {
     UTexture2D* loadedT2D = nullptr;
@@ -77,22 +52,12 @@ UTexture2D* loadTexture2DFromFile(const FString& fullFilePath)
     return loadedT2D;
 }
 
-void CopyTexture2DFragment(UTexture2D* destination, const UTexture2D* source, int start_x, int start_y, int width, int height)
-{
-    auto dst_size = FVector2D(destination->GetSizeX(), destination->GetSizeY());
-    auto &src_bulk = source->PlatformData->Mips[0].BulkData;
-    auto &dst_bulk = destination->PlatformData->Mips[0].BulkData;
-
-    auto src_pixels = static_cast<const FColor*>(src_bulk.LockReadOnly());
-    auto dst_pixels = static_cast<FColor*>(dst_bulk.Lock(LOCK_READ_WRITE));
-    for (int y = 0; y < height; ++y)
-        FMemory::Memcpy(dst_pixels + y * destination->GetSizeX(),
-                    src_pixels + (y + start_y) * source->GetSizeX() + start_x,
-                    width * sizeof(FColor));
-    src_bulk.Unlock();
-    dst_bulk.Unlock();
-    destination->UpdateResource();
-}
+DECLARE_CYCLE_STAT(TEXT("Process SciVi messages"), STAT_SciViProcessMessages, STATGROUP_SciVi);
+DECLARE_CYCLE_STAT(TEXT("Apply command"), STAT_SciViApplyCommand, STATGROUP_SciVi);
+DECLARE_CYCLE_STAT(TEXT("Install stimulus"), STAT_SciViInstallStimulus, STATGROUP_SciVi);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Inbound queue depth"), STAT_SciViQueueDepth, STATGROUP_SciVi);
+DECLARE_DWORD_COUNTER_STAT(TEXT("Commands applied"), STAT_SciViCommandsApplied, STATGROUP_SciVi);
+DECLARE_FLOAT_ACCUMULATOR_STAT(TEXT("Commands time (ms)"), STAT_SciViCommandsTime, STATGROUP_SciVi);
 
 //-------------------------- API ------------------------
 
@@ -104,63 +69,209 @@ AReadingTrackerGameMode::AReadingTrackerGameMode(const FObjectInitializer& Objec
     RecordingMenuClass = RecordingWidgetClass.Class;
 }
 
+void AReadingTrackerGameMode::InitGame(const FString& MapName, const FString& Options, FString& ErrorMessage)
+{
+    Super::InitGame(MapName, Options, ErrorMessage);
+    //read before any actor begins play, the informant doesn't start sampling the eye tracker in a replay
+    FParse::Value(FCommandLine::Get(), TEXT("SciViReplay="), replay_directory);
+    FParse::Value(FCommandLine::Get(), TEXT("SciViReplaySpeed="), replay_speed);
+}
+
 void AReadingTrackerGameMode::BeginPlay()
 {
     Super::BeginPlay();
+    if (IsReplaying())
+    {
+        StartReplay();
+        return;
+    }
     auto instance = SRanipalEye_Framework::Instance();
     if (instance)
         instance->StartFramework(EyeVersion);
 
+    if (RecordSession)
+    {
+        const FString sessions_directory = FPaths::ProjectSavedDir() / TEXT("Sessions");
+        RecoverSessionLogs(sessions_directory);
+        if (SessionsKept > 0)
+            PruneSessionLogs(sessions_directory, SessionsKept - 1);
+        session_recorder = MakeUnique<FSessionRecorder>();
+        session_recorder->Open(sessions_directory / FDateTime::Now().ToString(TEXT("%Y%m%d-%H%M%S")), (int64)SessionSegmentMB * 1024 * 1024);
+        session_flush_time = FPlatformTime::Seconds();
+    }
 }
 
 void AReadingTrackerGameMode::Tick(float DeltaTime)
 {
     Super::Tick(DeltaTime);
-    FString json_text;
-    if (message_queue.Dequeue(json_text))
+    LogSendQueueStatistics(DeltaTime);
+    ProcessMessageQueue();
+    InstallPreparedStimulus();
+    TickReplay(DeltaTime);
+    if (gaze_batch.Num() > 0 && (FPlatformTime::Seconds() - gaze_batch_start) * 1000.0 >= WSGazeBatchMs)
+        FlushGazeBatch();
+    //the pages are written by the OS anyway, this bounds what a power loss takes
+    if (session_recorder && FPlatformTime::Seconds() - session_flush_time >= 1.0)
+    {
+        session_recorder->Flush();
+        session_flush_time = FPlatformTime::Seconds();
+    }
+}
+
+void AReadingTrackerGameMode::ProcessMessageQueue()
+{
+    SCOPE_CYCLE_COUNTER(STAT_SciViProcessMessages);
+    int32 depth = message_queue_depth.load(std::memory_order_relaxed);
+    SET_DWORD_STAT(STAT_SciViQueueDepth, depth);
+    ws_max_queue_depth = FMath::Max(ws_max_queue_depth, depth);
+
+    const double start_time = FPlatformTime::Seconds();
+    const double deadline = start_time + WSCommandBudgetMs * 0.001;
+    int32 applied = 0;
+    //at least one command per frame, so the queue is drained even with a zero budget
+    while (applied == 0 || FPlatformTime::Seconds() < deadline)
+    {
+        FSciViCommand command;
+        if (!message_queue.Dequeue(command))
+            break;
+        message_queue_depth.fetch_sub(1, std::memory_order_relaxed);
+        const double command_start = FPlatformTime::Seconds();
+        ApplyCommand(command);
+        const double command_ms = (FPlatformTime::Seconds() - command_start) * 1000.0;
+        ws_max_command_ms = FMath::Max(ws_max_command_ms, command_ms);
+        INC_DWORD_STAT(STAT_SciViCommandsApplied);
+        ++applied;
+    }
+    ws_commands_applied += applied;
+    SET_FLOAT_STAT(STAT_SciViCommandsTime, (FPlatformTime::Seconds() - start_time) * 1000.0);
+}
+
+void AReadingTrackerGameMode::ApplyCommand(FSciViCommand& command)
+{
+    SCOPE_CYCLE_COUNTER(STAT_SciViApplyCommand);
+    if (command.IsType<FSciViCalibrateCommand>())
+        CalibrateVR();
+    else if (command.IsType<FSciViCustomCalibrateCommand>())
+        stimulus->customCalibrate();
+    else if (auto mc_visibility = command.TryGet<FSciViSetMCVisibilityCommand>())
+        informant->SetVisibility_MC_Right(mc_visibility->visibility);
+    else if (auto speech = command.TryGet<FSciViSpeechCommand>())
     {
-        TSharedPtr<FJsonObject> jsonParsed;
-        TSharedRef<TJsonReader<TCHAR>> jsonReader = TJsonReaderFactory<TCHAR>::Create(json_text);
-        if (FJsonSerializer::Deserialize(jsonReader, jsonParsed))
+        if (informant->IsRecording()) 
         {
-            if (jsonParsed->TryGetField("calibrate"))
-                CalibrateVR();
-            else if (jsonParsed->TryGetField("customCalibrate"))
-                stimulus->customCalibrate();
-            else if (jsonParsed->TryGetField("setMotionControllerVisibility"))
+            auto root = recording_menu->GetWidget();
+            auto textWidget = Cast<UEditableText>(root->GetWidgetFromName("textNewName"));
+            if (textWidget)
             {
-                auto PC = GetWorld()->GetFirstPlayerController();
-                bool visibility = jsonParsed->GetBoolField("setMotionControllerVisibility");
-                informant->SetVisibility_MC_Right(visibility);
-            }
-            else if (jsonParsed->TryGetField("Speech"))
-            {
-                if (informant->IsRecording()) 
-                {
-                    auto speech = jsonParsed->GetStringField("Speech");
-                    auto root = recording_menu->GetWidget();
-                    auto textWidget = Cast<UEditableText>(root->GetWidgetFromName("textNewName"));
-                    if (textWidget)
-                    {
-                        auto name = textWidget->GetText().ToString();
-                        name.Appendf(TEXT(" %s"), *speech);
-                        textWidget->SetText(FText::FromString(name));
-                    }
-                }
-            }
-            else {
-                for (auto wall : walls) 
-                {
-                    wall->SetVisibility(false);
-                    wall->ClearList();
-                }
-                ParseNewImage(jsonParsed);
+                auto name = textWidget->GetText().ToString();
+                name.Appendf(TEXT(" %s"), *speech->text);
+                textWidget->SetText(FText::FromString(name));
             }
         }
+    }
+    else if (auto new_stimulus = command.TryGet<FSciViNewStimulusCommand>())
+    {
+        if (auto recorder = GetSessionRecorder())
+            recorder->WriteStimulus(GetSessionTime(), *new_stimulus);
+        //a stimulus still being prepared isn't shown anymore, it's only cached
+        if (new_stimulus->preload)
+        {
+            if (stimulus->IsStimulusCached(new_stimulus->hash))
+                return;
+        }
+        else
+        {
+            wanted_stimulus.Reset();
+            if (ShowStimulus(new_stimulus->hash))
+                return;
+            wanted_stimulus = new_stimulus->hash;
+        }
+        FSHAHash hash = new_stimulus->hash;
+        if (!pending_stimuli.ContainsByPredicate([&hash](const FPendingStimulus& pending) { return pending.hash == hash; }))
+            pending_stimuli.Add(FPendingStimulus{ hash, PrepareStimulusAsync(MoveTemp(*new_stimulus)) });
+    }
+    else if (auto show = command.TryGet<FSciViShowCommand>())
+    {
+        wanted_stimulus.Reset();
+        if (ShowStimulus(show->hash))
+            return;
+        if (pending_stimuli.ContainsByPredicate([show](const FPendingStimulus& pending) { return pending.hash == show->hash; }))
+            wanted_stimulus = show->hash;//shown as soon as its preload is ready
+        else
+            UE_LOG(LogTemp, Warning, TEXT("Stimulus %s wasn't preloaded"), *show->hash.ToString());
+    }
+}
 
+bool AReadingTrackerGameMode::ShowStimulus(const FSHAHash& hash, bool count_lookup)
+{
+    if (!stimulus->ShowCachedStimulus(hash, count_lookup))
+        return false;
+    for (auto wall : walls) 
+    {
+        wall->SetVisibility(false);
+        wall->ClearList();
+    }
+    if (auto recorder = GetSessionRecorder())
+    {
+        auto widget = stimulus->Stimulus;
+        recorder->WriteStimulusShown(GetSessionTime(), hash, widget->GetComponentTransform(), widget->GetDrawSize());
+    }
+    return true;
+}
+
+void AReadingTrackerGameMode::InstallPreparedStimulus()
+{
+    //one stimulus per frame, its textures are created on the game thread
+    int ready = pending_stimuli.IndexOfByPredicate([](const FPendingStimulus& pending) { return pending.future.IsReady(); });
+    if (ready == INDEX_NONE)
+        return;
+    FPendingStimulus pending = MoveTemp(pending_stimuli[ready]);
+    pending_stimuli.RemoveAt(ready);
+    FPreparedStimulus& prepared = *pending.future.Get();
+    if (!prepared.valid)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Stimulus: %s"), *prepared.error);
+        return;
     }
 
+    //the same stimulus can be requested again while it's prepared, the second copy isn't uploaded
+    if (stimulus->IsStimulusCached(prepared.hash))
+    {
+        if (wanted_stimulus.IsSet() && wanted_stimulus.GetValue() == prepared.hash)
+        {
+            wanted_stimulus.Reset();
+            ShowStimulus(prepared.hash, false);
+        }
+        return;
+    }
 
+    SCOPE_CYCLE_COUNTER(STAT_SciViInstallStimulus);
+    double install_start = FPlatformTime::Seconds();
+    UTexture2D* texture = stimulus->AcquireTexture(prepared.width, prepared.height);
+    if (!texture)
+        return;
+    URTHelpers::updateTexture2DFromBGRA(texture, prepared.bgra);
+    TArray<FAOI> AOIs;
+    AOIs.Reserve(prepared.AOIs.Num());
+    for (auto& prepared_aoi : prepared.AOIs)
+    {
+        FAOI aoi;
+        aoi.name = MoveTemp(prepared_aoi.name);
+        aoi.path = MoveTemp(prepared_aoi.path);
+        aoi.bbox = prepared_aoi.bbox;
+        AOIs.Add(aoi);
+    }
+    int AOIs_count = AOIs.Num();
+    stimulus->CacheStimulus(prepared.hash, texture, MoveTemp(prepared.bgra), prepared.scale_x, prepared.scale_y, MoveTemp(AOIs), MoveTemp(prepared.index));
+    if (wanted_stimulus.IsSet() && wanted_stimulus.GetValue() == prepared.hash)
+    {
+        wanted_stimulus.Reset();
+        ShowStimulus(prepared.hash, false);//the miss is already counted
+    }
+    double now = FPlatformTime::Seconds();
+    UE_LOG(LogTemp, Display, TEXT("Stimulus %s %dx%d, %d AOIs: parse %.2f ms, decode %.2f ms, AOI index %.2f ms, install %.2f ms, %.2f ms from the command"),
+        *prepared.hash.ToString(), prepared.width, prepared.height, AOIs_count, prepared.parse_ms, prepared.decode_ms, prepared.index_ms,
+        (now - install_start) * 1000.0, (now - prepared.start_time) * 1000.0);
 }
 
 void AReadingTrackerGameMode::EndPlay(const EEndPlayReason::Type EndPlayReason)
@@ -169,7 +280,11 @@ void AReadingTrackerGameMode::EndPlay(const EEndPlayReason::Type EndPlayReason)
     m_server.stop();
     m_serverThread->join();
     m_serverThread.Reset();
-    SRanipalEye_Framework::Instance()->StopFramework();
+    if (IsReplaying())
+        FinishReplay();
+    else
+        SRanipalEye_Framework::Instance()->StopFramework();
+    session_recorder.Reset();
 }
 
 bool AReadingTrackerGameMode::RayTrace(const AActor* ignoreActor, const FVector& origin, const FVector& end, FHitResult& hitResult)
@@ -320,9 +435,12 @@ void AReadingTrackerGameMode::ReplaceWalls(float radius)
 
 void AReadingTrackerGameMode::AddAOIsToList(AWordListWall* const wall)
 {
-    for (auto aoi : stimulus->SelectedAOIs) 
+    TArray<FAOIThumbnail> thumbnails;
+    stimulus->GetAOIThumbnails(stimulus->SelectedAOIs, thumbnails);
+    for (int i = 0; i < stimulus->SelectedAOIs.Num(); ++i)
     {
-        wall->AddAOI(aoi);
+        auto aoi = stimulus->SelectedAOIs[i];
+        wall->AddAOI(aoi, thumbnails[i]);
         SendWallLogToSciVi(EWallLogAction::AddAOI, wall->GetWallName(), aoi->name);
     }
     //clear selection on stimulus
@@ -358,7 +476,9 @@ void AReadingTrackerGameMode::SendWallLogToSciVi(EWallLogAction Action, const FS
             "\"Wall\": \"%s\","
             "\"AOI\": \"%s\"}"), *ActionStr, *WallName, *AOI);
     }
-    this->Broadcast(msg);
+    this->Broadcast(msg, EWSLane::Bulk);
+    if (auto recorder = GetSessionRecorder())
+        recorder->WriteWallLog(GetSessionTime(), (uint8)Action, WallName, AOI);
 }
 
 void AReadingTrackerGameMode::CalibrateVR()
@@ -370,102 +490,372 @@ void AReadingTrackerGameMode::CalibrateVR()
 
 void AReadingTrackerGameMode::initWS()
 {
-    m_server.config.port = 81;
+    m_server.config.port = (unsigned short)WSPort;
+    m_server.config.thread_pool_size = FMath::Max(WSThreads, 1);
+    m_server.config.timeout_request = WSRequestTimeout;
+    m_server.config.timeout_idle = WSIdleTimeout;
+    m_server.config.permessage_deflate.enabled = EnableWSCompression;
+    m_server.config.permessage_deflate.compression_threshold = 64;//short messages grow when compressed
+
+    //a stalled client must not make the send queues grow without limit
+    WSServer::SendQueueLimit gaze_limit;
+    gaze_limit.max_messages = WSGazeQueueLimit;
+    gaze_limit.policy = WSServer::SendQueueLimit::Policy::drop_oldest;
+    m_server.config.send_queue_limits[(int)EWSMessageClass::Gaze] = gaze_limit;
+    WSServer::SendQueueLimit audio_limit;
+    audio_limit.max_messages = WSAudioQueueLimit;
+    audio_limit.policy = WSServer::SendQueueLimit::Policy::drop_oldest;
+    m_server.config.send_queue_limits[(int)EWSMessageClass::Audio] = audio_limit;
+    WSServer::SendQueueLimit event_limit;
+    event_limit.max_bytes = (size_t)WSEventQueueLimitMB * 1024 * 1024;
+    event_limit.policy = WSServer::SendQueueLimit::Policy::disconnect;
+    m_server.config.send_queue_limits[(int)EWSMessageClass::Event] = event_limit;
 
     auto& ep = m_server.endpoint["^/ue4/?$"];
 
+    ep.on_handshake = [](std::shared_ptr<WSServer::Connection> connection, SimpleWeb::CaseInsensitiveMultimap& response_header)
+    {
+        //clients offering the binary gaze subprotocol get binary gaze records, the others keep getting JSON
+        auto range = connection->header.equal_range("Sec-WebSocket-Protocol");
+        for (auto it = range.first; it != range.second; ++it)
+        {
+            const std::string& offers = it->second;
+            for (std::size_t start = 0, end; start < offers.size(); start = end + 1)
+            {
+                end = std::min(offers.find(',', start), offers.size());
+                auto first = offers.find_first_not_of(' ', start);
+                auto last = offers.find_last_not_of(' ', end - 1);
+                if (first < end && offers.compare(first, last + 1 - first, SCIVI_GAZE_SUBPROTOCOL) == 0)
+                {
+                    response_header.emplace("Sec-WebSocket-Protocol", SCIVI_GAZE_SUBPROTOCOL);
+                    return SimpleWeb::StatusCode::information_switching_protocols;
+                }
+            }
+        }
+        return SimpleWeb::StatusCode::information_switching_protocols;
+    };
+
     ep.on_message = [this](std::shared_ptr<WSServer::Connection> connection, std::shared_ptr<WSServer::InMessage> msg)
     {
-        auto str = FString(UTF8_TO_TCHAR(msg->string().c_str()));
-        message_queue.Enqueue(str);
+        //parsing and validation stay on the server threads, the game thread only applies ready commands
+        FSciViCommand command;
+        FString error;
+        bool parsed = (msg->fin_rsv_opcode & 0x0f) == 2 ?
+            ParseSciViBinaryCommand((const uint8*)msg->data(), (int32)msg->size(), command, error) :
+            ParseSciViCommand(msg->data(), (int32)msg->size(), command, error);
+        if (!parsed)
+        {
+            UE_LOG(LogTemp, Warning, TEXT("WebSocket: invalid command, %s"), *error);
+            return;
+        }
+        message_queue_depth.fetch_add(1, std::memory_order_relaxed);
+        message_queue.Enqueue(MoveTemp(command));
     };
 
-    ep.on_open = [](std::shared_ptr<WSServer::Connection> connection)
+    //SendGaze reads the counters on every sample, so it doesn't copy the connection set
+    auto client_counter = [this](const std::shared_ptr<WSServer::Connection>& connection) -> std::atomic<int32>&
     {
-        UE_LOG(LogTemp, Display, TEXT("WebSocket: Opened"));
+        return connection->subprotocol == SCIVI_GAZE_SUBPROTOCOL ? ws_binary_clients : ws_json_clients;
     };
 
-    ep.on_close = [](std::shared_ptr<WSServer::Connection> connection, int status, const std::string&)
+    ep.on_open = [client_counter](std::shared_ptr<WSServer::Connection> connection)
     {
-        UE_LOG(LogTemp, Display, TEXT("WebSocket: Closed"));
+        client_counter(connection).fetch_add(1, std::memory_order_relaxed);
+        UE_LOG(LogTemp, Display, TEXT("WebSocket: Opened"));
     };
 
-    ep.on_handshake = [](std::shared_ptr<WSServer::Connection>, SimpleWeb::CaseInsensitiveMultimap&)
+    ep.on_close = [client_counter](std::shared_ptr<WSServer::Connection> connection, int status, const std::string&)
     {
-        return SimpleWeb::StatusCode::information_switching_protocols;
+        client_counter(connection).fetch_sub(1, std::memory_order_relaxed);
+        UE_LOG(LogTemp, Display, TEXT("WebSocket: Closed"));
     };
 
-    ep.on_error = [](std::shared_ptr<WSServer::Connection> connection, const SimpleWeb::error_code& ec)
+    ep.on_error = [client_counter](std::shared_ptr<WSServer::Connection> connection, const SimpleWeb::error_code& ec)
     {
+        client_counter(connection).fetch_sub(1, std::memory_order_relaxed);
         UE_LOG(LogTemp, Warning, TEXT("WebSocket: Error"));
     };
 
     m_serverThread = MakeUnique<std::thread>(&AReadingTrackerGameMode::wsRun, this);
 }
 
-void AReadingTrackerGameMode::ParseNewImage(const TSharedPtr<FJsonObject>& json)
+void AReadingTrackerGameMode::Broadcast(FString& message, EWSLane lane, EWSMessageClass message_class)
+{
+    BroadcastJSON(message, GetSessionTime(), lane, message_class, nullptr);
+}
+
+void AReadingTrackerGameMode::BroadcastJSON(const FString& message, double time, EWSLane lane, EWSMessageClass message_class, const ConnectionFilter& filter)
 {
-    FString image_textdata = json->GetStringField("image");
-    TArray<uint8> img;
-    FString png = "data:image/png;base64,";
-    FString jpg = "data:image/jpeg;base64,";
-    EImageFormat fmt = EImageFormat::Invalid;
-    int startPos = 0;
-    if (image_textdata.StartsWith(png))
+    auto msg = FString::Printf(TEXT("{\"Time\": %f, %s}"), time, *message);
+    //encode once, the same frame is queued to every connection
+    FTCHARToUTF8 utf8(*msg);
+    if (replay_json)
     {
-        fmt = EImageFormat::PNG;
-        startPos = png.Len();
+        replay_json->Serialize(const_cast<ANSICHAR*>(utf8.Get()), utf8.Length());
+        ANSICHAR end_of_line = '\n';
+        replay_json->Serialize(&end_of_line, 1);
     }
-    else if (image_textdata.StartsWith(jpg))
+    auto out_message = std::make_shared<WSServer::OutMessage>(utf8.Length());
+    out_message->write(utf8.Get(), utf8.Length());
+    auto ws_lane = lane == EWSLane::Realtime ? WSServer::Lane::high : WSServer::Lane::bulk;
+    m_server.broadcast(out_message, 129, (int)message_class, ws_lane, filter);
+}
+
+void AReadingTrackerGameMode::BroadcastGaze(FSciViGazeRecord& record, EWSLane lane, EWSMessageClass message_class)
+{
+    //gaze samples carry the time they were taken, events are stamped now
+    if (record.timestamp == 0.0)
+        record.timestamp = GetSessionTime();
+    if (auto recorder = GetSessionRecorder())
+        recorder->WriteGazeMessage(record);
+    //plain samples wait for the batch, events go at once but after the samples taken before them
+    if (message_class == EWSMessageClass::Gaze && WSGazeBatchMs > 0.0f)
     {
-        fmt = EImageFormat::JPEG;
-        startPos = jpg.Len();
+        if (gaze_batch.Num() == 0)
+        {
+            gaze_batch_start = FPlatformTime::Seconds();
+            gaze_batch_lane = lane;
+        }
+        gaze_batch.Add(record);
+        if (gaze_batch.Num() >= WSGazeBatchSize || (FPlatformTime::Seconds() - gaze_batch_start) * 1000.0 >= WSGazeBatchMs)
+            FlushGazeBatch();
+        return;
     }
+    FlushGazeBatch();
+    SendGaze(&record, 1, lane, message_class);
+}
+
+void AReadingTrackerGameMode::FlushGazeBatch()
+{
+    if (gaze_batch.Num() == 0)
+        return;
+    SendGaze(gaze_batch.GetData(), gaze_batch.Num(), gaze_batch_lane, EWSMessageClass::Gaze);
+    gaze_batch.Reset();
+}
+
+static FString GazeToJSON(const FSciViGazeRecord& record)
+{
+    return FString::Printf(TEXT("{\"uv\": [%f, %f],"
+                                "\"origin\": [%f, %f, %f],"
+                                "\"direction\": [%F, %F, %F],"
+                                "\"lpdmm\": %F, \"rpdmm\": %F,"
+                                "\"cf\": %F, \"AOI_index\": %i,"
+                                "\"Action\": \"%s\"}"),
+        record.uv[0], record.uv[1],
+        record.origin[0], record.origin[1], record.origin[2],
+        record.direction[0], record.direction[1], record.direction[2],
+        record.left_pupil_diameter_mm, record.right_pupil_diameter_mm, record.cf, record.AOI_index,
+        SciViGazeActionName((ESciViGazeAction)record.action));
+}
 
-    if (fmt != EImageFormat::Invalid &&
-        FBase64::Decode(&(image_textdata.GetCharArray()[startPos]), img))
+void AReadingTrackerGameMode::SendGaze(const FSciViGazeRecord* records, int32 count, EWSLane lane, EWSMessageClass message_class)
+{
+    auto is_binary_client = [](const std::shared_ptr<WSServer::Connection>& connection) { return connection->subprotocol == SCIVI_GAZE_SUBPROTOCOL; };
+    const bool has_binary_clients = ws_binary_clients.load(std::memory_order_relaxed) > 0;
+    const bool has_json_clients = ws_json_clients.load(std::memory_order_relaxed) > 0;
+
+    if (replay_gaze)
+        replay_gaze->Serialize(const_cast<FSciViGazeRecord*>(records), count * sizeof(FSciViGazeRecord));
+    if (has_binary_clients)
     {
-        float sx = json->GetNumberField("scaleX");
-        float sy = json->GetNumberField("scaleY");
-        UTexture2D* texture = loadTexture2DFromBytes(img, fmt);
-        TArray<FAOI> AOIs;
-        for (auto aoi_text : json->GetArrayField("AOIs"))
+        //a batch is the records back to back in one message
+        auto out_message = std::make_shared<WSServer::OutMessage>(count * sizeof(FSciViGazeRecord));
+        out_message->write(reinterpret_cast<const char*>(records), count * sizeof(FSciViGazeRecord));
+        auto ws_lane = lane == EWSLane::Realtime ? WSServer::Lane::high : WSServer::Lane::bulk;
+        m_server.broadcast(out_message, 130, (int)message_class, ws_lane, is_binary_client);
+    }
+    //the floats are only formatted if some client still uses JSON
+    if (has_json_clients || replay_json)
+    {
+        FString json;
+        if (count == 1)
+            json = TEXT("\"Gaze\": ") + GazeToJSON(records[0]);
+        else
         {
-            FAOI aoi;
-            auto nameField = aoi_text->AsObject()->TryGetField("name");
-            if (nameField)
-                aoi.name = nameField->AsString();
-            auto pathField = aoi_text->AsObject()->TryGetField("path");
-            if (pathField)
-            {
-                auto path = pathField->AsArray();
-                for (auto point : path)
-                    aoi.path.Add(FVector2D(point->AsArray()[0]->AsNumber(), point->AsArray()[1]->AsNumber()));
-            }
-            auto bboxField = aoi_text->AsObject()->TryGetField("bbox");
-            if (bboxField)
+            //"GazeBatch": [{"Time": ..., "uv": ...}, ...], every sample has its own time
+            json.Reserve(count * 256);
+            json += TEXT("\"GazeBatch\": [");
+            for (int32 i = 0; i < count; ++i)
             {
-                auto bbox = bboxField->AsArray();
-                aoi.bbox = FBox2D(FVector2D(bbox[0]->AsNumber(), bbox[1]->AsNumber()),
-                    FVector2D(bbox[2]->AsNumber(), bbox[3]->AsNumber()));
+                if (i > 0)
+                    json += TEXT(", ");
+                json += FString::Printf(TEXT("{\"Time\": %f, "), records[i].timestamp);
+                json += GazeToJSON(records[i]).RightChop(1);
             }
-            auto size = aoi.bbox.GetSize();
-            auto start = aoi.bbox.Min;
-            aoi.image = UTexture2D::CreateTransient(size.X, size.Y);
-            aoi.image->AddToRoot();
-            CopyTexture2DFragment(aoi.image, texture, start.X, start.Y, size.X, size.Y);
-            AOIs.Add(aoi);
+            json += TEXT("]");
         }
-        if (texture)
-            stimulus->updateDynTex(texture, sx, sy, AOIs);
+        BroadcastJSON(json, records[0].timestamp, lane, message_class,
+            [&is_binary_client](const std::shared_ptr<WSServer::Connection>& connection) { return !is_binary_client(connection); });
     }
 }
 
-void AReadingTrackerGameMode::Broadcast(FString& message)
+void AReadingTrackerGameMode::LogSendQueueStatistics(float DeltaTime)
 {
-    FDateTime t = FDateTime::Now();
-    float time = t.ToUnixTimestamp() * 1000.0f + t.GetMillisecond();
-    auto msg = FString::Printf(TEXT("{\"Time\": %f, %s}"), time, *message);
-    for (auto& connection : m_server.get_connections())//broadcast to everyone
-        connection->send(TCHAR_TO_UTF8(*msg));
-}
\ No newline at end of file
+    ws_statistics_time += DeltaTime;
+    if (ws_statistics_time < 1.0f)
+        return;
+    ws_statistics_time = 0.0f;
+    auto statistics = m_server.get_send_queue_statistics();
+    if (statistics.dropped_messages != ws_dropped_messages || statistics.disconnects != ws_disconnects)
+    {
+        UE_LOG(LogTemp, Warning, TEXT("WebSocket: slow clients, %llu messages dropped (%llu bytes), %llu clients disconnected, %llu bytes queued"),
+            (uint64)statistics.dropped_messages, (uint64)statistics.dropped_bytes, (uint64)statistics.disconnects, (uint64)statistics.queued_bytes);
+        ws_dropped_messages = statistics.dropped_messages;
+        ws_disconnects = statistics.disconnects;
+    }
+    if (ws_commands_applied > 0)
+    {
+        UE_LOG(LogTemp, Display, TEXT("WebSocket: %u commands applied, max queue depth %d, slowest command %.2f ms"),
+            ws_commands_applied, ws_max_queue_depth, ws_max_command_ms);
+        ws_commands_applied = 0;
+        ws_max_queue_depth = 0;
+        ws_max_command_ms = 0.0;
+    }
+}
+
+//---------------------- Session replay ------------------
+
+//A recorded session (SessionLog.h) is fed through the informant and the stimulus instead of the headset:
+//  UE4Editor.exe ReadingTracker.uproject -game -nullrhi -SciViReplay=<session directory> [-SciViReplaySpeed=1] [-SciViReplayOut=<path>]
+//The messages go to <path>.json and the gaze records to <path>.gaze (<session directory>/replay by default).
+//Everything the pipeline reads from the clock gets the time of the replayed record, so two replays of a session
+//write the same bytes. Without a renderer the game quits when the session ends.
+void AReadingTrackerGameMode::StartReplay()
+{
+    replay_reader = MakeUnique<FSessionLogReader>();
+    if (!replay_reader->Open(replay_directory))
+    {
+        UE_LOG(LogTemp, Warning, TEXT("Replay: no session log in %s"), *replay_directory);
+        replay_reader.Reset();
+        return;
+    }
+    FString output = replay_directory / TEXT("replay");
+    FParse::Value(FCommandLine::Get(), TEXT("SciViReplayOut="), output);
+    replay_json.Reset(IFileManager::Get().CreateFileWriter(*(output + TEXT(".json"))));
+    replay_gaze.Reset(IFileManager::Get().CreateFileWriter(*(output + TEXT(".gaze"))));
+    //batches are cut by the wall clock, the output would differ from run to run
+    WSGazeBatchMs = 0.0f;
+    replay_has_record = replay_reader->Next(replay_record);
+    replay_time = replay_has_record ? replay_record.time : 0.0;
+    replay_start_seconds = FPlatformTime::Seconds();
+    UE_LOG(LogTemp, Display, TEXT("Replay: %s to %s, %.1fx"), *replay_directory, *output, replay_speed);
+}
+
+void AReadingTrackerGameMode::TickReplay(float DeltaTime)
+{
+    if (!replay_reader || !informant || !stimulus)
+        return;
+    const double deadline = FPlatformTime::Seconds() + ReplayFrameBudgetMs * 0.001;
+    if (replay_speed > 0.0f)
+        replay_time += DeltaTime * 1000.0 * replay_speed;
+    while (replay_has_record)
+    {
+        if (replay_speed > 0.0f ? replay_record.time > replay_time : FPlatformTime::Seconds() >= deadline)
+            return;
+        ReplayRecord(replay_record);
+        replay_has_record = replay_reader->Next(replay_record);
+    }
+    FinishReplay();
+    if (!FApp::CanEverRender())
+        FPlatformMisc::RequestExit(false);
+}
+
+void AReadingTrackerGameMode::ReplayRecord(const FSessionRecord& record)
+{
+    SetSessionReplayTime(record.time);
+    ++replay_records;
+    switch (record.type)
+    {
+    case ESessionRecord::GazeSample:
+    {
+        FSessionGazeSample sample;
+        if (record.payload.Num() < sizeof(sample))
+            break;
+        FMemory::Memcpy(&sample, record.payload.GetData(), sizeof(sample));
+        FGaze gaze;
+        gaze.origin = FVector(sample.origin[0], sample.origin[1], sample.origin[2]);
+        gaze.direction = FVector(sample.direction[0], sample.direction[1], sample.direction[2]);
+        gaze.left_pupil_diameter_mm = sample.left_pupil_diameter_mm;
+        gaze.left_pupil_openness = sample.left_pupil_openness;
+        gaze.right_pupil_diameter_mm = sample.right_pupil_diameter_mm;
+        gaze.right_pupil_openness = sample.right_pupil_openness;
+        gaze.timestamp = record.time;
+        informant->ReplayGaze(gaze, sample.valid != 0);
+        ++replay_samples;
+        break;
+    }
+    case ESessionRecord::Trigger:
+    {
+        FSessionTrigger trigger;
+        if (record.payload.Num() < sizeof(trigger))
+            break;
+        FMemory::Memcpy(&trigger, record.payload.GetData(), sizeof(trigger));
+        informant->ReplayTrigger(trigger.pressed != 0, FVector(trigger.origin[0], trigger.origin[1], trigger.origin[2]),
+            FVector(trigger.end[0], trigger.end[1], trigger.end[2]));
+        break;
+    }
+    case ESessionRecord::ControllerVisibility:
+        if (record.payload.Num() >= 1)
+            informant->SetVisibility_MC_Right(record.payload[0] != 0);
+        break;
+    case ESessionRecord::Stimulus:
+    {
+        FSciViCommand command;
+        FString error;
+        if (!ParseSciViBinaryCommand(record.payload.GetData(), record.payload.Num(), command, error))
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Replay: invalid stimulus, %s"), *error);
+            break;
+        }
+        auto new_stimulus = command.TryGet<FSciViNewStimulusCommand>();
+        if (!new_stimulus || stimulus->IsStimulusCached(new_stimulus->hash))
+            break;
+        //prepared at once, the stimulus has to be cached when the record showing it comes
+        FSHAHash hash = new_stimulus->hash;
+        pending_stimuli.Add(FPendingStimulus{ hash, PrepareStimulusAsync(MoveTemp(*new_stimulus)) });
+        pending_stimuli.Last().future.Wait();
+        InstallPreparedStimulus();
+        break;
+    }
+    case ESessionRecord::StimulusShown:
+    {
+        FSessionStimulusShown shown;
+        if (record.payload.Num() < sizeof(shown))
+            break;
+        FMemory::Memcpy(&shown, record.payload.GetData(), sizeof(shown));
+        FSHAHash hash;
+        FMemory::Memcpy(hash.Hash, shown.hash, sizeof(shown.hash));
+        if (!ShowStimulus(hash, false))
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Replay: stimulus %s isn't in the session log"), *hash.ToString());
+            break;
+        }
+        //the recorded rays only hit the same AOIs if the billboard is where it was
+        FTransform recorded(FQuat(shown.rotation[0], shown.rotation[1], shown.rotation[2], shown.rotation[3]),
+            FVector(shown.location[0], shown.location[1], shown.location[2]), FVector(shown.scale[0], shown.scale[1], shown.scale[2]));
+        if (!replay_pose_warned && !recorded.Equals(stimulus->Stimulus->GetComponentTransform(), 0.01f))
+        {
+            UE_LOG(LogTemp, Warning, TEXT("Replay: the stimulus billboard isn't where it was recorded, the level differs"));
+            replay_pose_warned = true;
+        }
+        break;
+    }
+    default:
+        //gaze messages and wall logs are what the recorded session sent, the replay sends its own
+        break;
+    }
+}
+
+void AReadingTrackerGameMode::FinishReplay()
+{
+    if (!replay_reader)
+        return;
+    FlushGazeBatch();
+    const double seconds = FPlatformTime::Seconds() - replay_start_seconds;
+    UE_LOG(LogTemp, Display, TEXT("Replay: %u records, %u gaze samples in %.2f s, %.0f samples/s"),
+        replay_records, replay_samples, seconds, seconds > 0.0 ? replay_samples / seconds : 0.0);
+    replay_reader.Reset();
+    replay_json.Reset();
+    replay_gaze.Reset();
+    SetSessionReplayTime(0.0);
+}
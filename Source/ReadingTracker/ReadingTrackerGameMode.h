@@ -16,6 +16,10 @@ THIRD_PARTY_INCLUDES_END
 #include "GameFramework/GameModeBase.h"
 #include "SRanipal_Eyes_Enums.h"
 #include "ReadingTracker.h"
+#include "Private/SciViGaze.h"
+#include "Private/SciViCommands.h"
+#include "Private/StimulusPipeline.h"
+#include "Private/SessionLog.h"
 #include "ReadingTrackerGameMode.generated.h"
 
 //Channel to check collision with 
@@ -29,8 +33,6 @@ struct FAOI
 	UPROPERTY()
 	TArray<FVector2D> path;
 	FBox2D bbox;
-	UPROPERTY()
-	UTexture2D* image;
 	inline bool IsPointInside(const FVector2D& pt) const
 	{
 		if (!bbox.IsInside(pt)) return false;
@@ -48,6 +50,14 @@ struct FAOI
 	}
 };
 
+//thumbnail of an AOI, it's cropped from the stimulus when a wall needs it first
+struct FAOIThumbnail
+{
+	UTexture2D* texture = nullptr;//atlas page shared with other AOIs of the stimulus
+	FBox2D uv = FBox2D(ForceInit);//region of the thumbnail in the atlas page
+	FVector2D size = FVector2D::ZeroVector;//in pixels
+};
+
 UENUM()
 enum class EWallLogAction
 {
@@ -57,6 +67,21 @@ enum class EWallLogAction
 	RemoveAOI UMETA(DisplayName = "RemoveAOI")
 };
 
+//classes of the messages sent to SciVi, each class has its own send queue limit per client
+enum class EWSMessageClass : int
+{
+	Event = 0,//stimulus and wall log events are never dropped, a client lagging too far behind is disconnected
+	Gaze,//the oldest queued samples are dropped
+	Audio//the oldest queued chunks are dropped
+};
+
+//priority of the messages sent to SciVi: waiting bulk messages are sent after the realtime ones
+enum class EWSLane
+{
+	Realtime,//gaze, must not wait behind audio or wall logs
+	Bulk
+};
+
 /**
  * 
  */
@@ -69,9 +94,56 @@ public:
 	virtual void BeginPlay() override;
 	virtual void Tick(float DeltaTime) override;
 	virtual void EndPlay(const EEndPlayReason::Type EndPlayReason) override;
+	virtual void InitGame(const FString& MapName, const FString& Options, FString& ErrorMessage) override;
 
 	UPROPERTY(EditAnywhere, BlueprintReadonly)
 	int MaxWallsCount = 5;
+	//compress WebSocket messages (permessage-deflate) when the client supports it
+	UPROPERTY(EditAnywhere, BlueprintReadonly)
+	bool EnableWSCompression = true;
+	//gaze messages (samples or batches) waiting to be sent to a slow client, the oldest are dropped above this count
+	UPROPERTY(EditAnywhere, BlueprintReadonly)
+	int WSGazeQueueLimit = 90;
+	//audio chunks waiting to be sent to a slow client, the oldest chunks are dropped above this count
+	UPROPERTY(EditAnywhere, BlueprintReadonly)
+	int WSAudioQueueLimit = 16;
+	//a client with more than this amount of other messages (in MB) waiting to be sent is disconnected
+	UPROPERTY(EditAnywhere, BlueprintReadonly)
+	int WSEventQueueLimitMB = 64;
+	UPROPERTY(EditAnywhere, BlueprintReadonly)
+	int WSPort = 81;
+	//threads running the WebSocket server, the handlers of one client never run concurrently
+	UPROPERTY(EditAnywhere, BlueprintReadonly)
+	int WSThreads = 2;
+	//seconds a client has to complete the handshake
+	UPROPERTY(EditAnywhere, BlueprintReadonly)
+	int WSRequestTimeout = 5;
+	//a client silent for this many seconds is disconnected, 0 - never
+	UPROPERTY(EditAnywhere, BlueprintReadonly)
+	int WSIdleTimeout = 0;
+	//time per frame (ms) to apply the commands received from SciVi, new stimuli are prepared on worker threads
+	UPROPERTY(EditAnywhere, BlueprintReadonly)
+	float WSCommandBudgetMs = 2.0f;
+	//LOOKAT samples are collected for this many ms and sent as one message ("GazeBatch" array in JSON,
+	//records back to back in binary), 0 - every sample is sent at once. Other gaze actions are never delayed.
+	UPROPERTY(EditAnywhere, BlueprintReadonly)
+	float WSGazeBatchMs = 0.0f;
+	//a batch is sent earlier when it has this many samples
+	UPROPERTY(EditAnywhere, BlueprintReadonly)
+	int WSGazeBatchSize = 16;
+	//gaze samples, AOI hits, triggers, wall logs and stimuli are written to Saved/Sessions/<start time>
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Session)
+	bool RecordSession = false;
+	//the oldest recorded sessions are deleted at start so that this many are left, the new one included, 0 - all are kept
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Session)
+	int SessionsKept = 20;
+	//size of a preallocated session log segment
+	UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Session)
+	int SessionSegmentMB = 64;
+	//-SciViReplay=<session directory>: the recorded session is fed to the stimulus instead of the headset, see StartReplay
+	bool IsReplaying() const { return !replay_directory.IsEmpty(); }
+	//nullptr if the session isn't recorded
+	FSessionRecorder* GetSessionRecorder() const { return session_recorder && session_recorder->IsOpen() ? session_recorder.Get() : nullptr; }
 
 	UFUNCTION(BlueprintCallable)
 	bool RayTrace(const AActor* ignoreActor, const FVector& origin, const FVector& end, FHitResult& hitResult);
@@ -117,13 +189,64 @@ public:
 //----------------------- SciVi networking --------------
 public:
 	void SendWallLogToSciVi(EWallLogAction Action, const FString& WallName, const FString& AOI = TEXT(""));
-	void Broadcast(FString& message);
+	void Broadcast(FString& message, EWSLane lane, EWSMessageClass message_class = EWSMessageClass::Event);
+	//binary record for the clients of the SCIVI_GAZE_SUBPROTOCOL subprotocol, JSON for the other clients, the timestamp is set here
+	void BroadcastGaze(FSciViGazeRecord& record, EWSLane lane, EWSMessageClass message_class);
 protected:
 	using WSServer = SimpleWeb::SocketServer<SimpleWeb::WS>;
 	void initWS();
 	void wsRun() { m_server.start(); }
-	void ParseNewImage(const TSharedPtr<FJsonObject>& json);
+	void ProcessMessageQueue();
+	void ApplyCommand(FSciViCommand& command);
+	void InstallPreparedStimulus();
+	bool ShowStimulus(const FSHAHash& hash, bool count_lookup = true);
+	struct FPendingStimulus
+	{
+		FSHAHash hash;
+		TFuture<TUniquePtr<FPreparedStimulus>> future;
+	};
+	TArray<FPendingStimulus> pending_stimuli;
+	TOptional<FSHAHash> wanted_stimulus;//shown when it's prepared, unless another stimulus is shown first
+	using ConnectionFilter = std::function<bool(const std::shared_ptr<WSServer::Connection>&)>;
+	void BroadcastJSON(const FString& message, double time, EWSLane lane, EWSMessageClass message_class, const ConnectionFilter& filter);
+	void SendGaze(const FSciViGazeRecord* records, int32 count, EWSLane lane, EWSMessageClass message_class);
+	void FlushGazeBatch();
+	TArray<FSciViGazeRecord> gaze_batch;//LOOKAT samples waiting for WSGazeBatchMs
+	double gaze_batch_start = 0.0;//FPlatformTime::Seconds() of the first sample in the batch
+	EWSLane gaze_batch_lane = EWSLane::Realtime;
 	WSServer m_server;
 	TUniquePtr<std::thread> m_serverThread = nullptr;//you can't use std::thread in UE4, because ue4 can't destroy it then gave is exiting
-	TQueue<FString> message_queue;
+	TQueue<FSciViCommand, EQueueMode::Mpsc> message_queue;//received messages are parsed on the server threads
+	std::atomic<int32> message_queue_depth{ 0 };
+	std::atomic<int32> ws_binary_clients{ 0 };//open connections with the SCIVI_GAZE_SUBPROTOCOL, updated on the server threads
+	std::atomic<int32> ws_json_clients{ 0 };
+	void LogSendQueueStatistics(float DeltaTime);
+	int32 ws_max_queue_depth = 0;
+	uint32 ws_commands_applied = 0;
+	double ws_max_command_ms = 0.0;
+	float ws_statistics_time = 0.0f;
+	size_t ws_dropped_messages = 0;
+	size_t ws_disconnects = 0;
+
+	TUniquePtr<FSessionRecorder> session_recorder;
+	double session_flush_time = 0.0;
+
+	//----------------- Session replay ----------------------
+	void StartReplay();
+	void TickReplay(float DeltaTime);
+	void ReplayRecord(const FSessionRecord& record);
+	void FinishReplay();
+	static const constexpr float ReplayFrameBudgetMs = 100.0f;//records replayed per frame when there is no real time to keep
+	FString replay_directory;
+	float replay_speed = 0.0f;//x real time, 0 - as fast as possible
+	TUniquePtr<FSessionLogReader> replay_reader;
+	FSessionRecord replay_record;//the next one
+	bool replay_has_record = false;
+	double replay_time = 0.0;//of the session
+	TUniquePtr<FArchive> replay_json;//every JSON message as it is sent, one per line
+	TUniquePtr<FArchive> replay_gaze;//every gaze record as the binary clients get it
+	bool replay_pose_warned = false;
+	uint32 replay_records = 0;
+	uint32 replay_samples = 0;
+	double replay_start_seconds = 0.0;
 };
@@ -11,6 +11,9 @@
 #include "SRanipalEye_Core.h"
 #include "IXRTrackingSystem.h"
 #include "Engine/CanvasRenderTarget2D.h"
+#include "Private/RTHelpers.h"
+#include "Private/AtlasPacker.h"
+#include "Async/ParallelFor.h"
 
 //custom calibration
 static const constexpr int TARGET_MAX_RADIUS = 15;
@@ -127,9 +130,10 @@ void AStimulus::BeginPlay()
         btn->OnClicked.AddDynamic(this, &AStimulus::OnClicked_CreateList);
 }
 
-void AStimulus::updateDynTex(UTexture2D* texture, float sx, float sy, const TArray<FAOI>& newAOIs)
+void AStimulus::updateDynTex(UTexture2D* texture, float sx, float sy, const TArray<FAOI>& newAOIs, const FAOIGridIndex& newAOIIndex)
 {
     AOIs = newAOIs;
+    AOIIndex = newAOIIndex;
     SelectedAOIs.Empty();
 
     SetActorScale3D(FVector(1.0f, sx, sy));
@@ -155,6 +159,261 @@ void AStimulus::updateDynTex(UTexture2D* texture, float sx, float sy, const TArr
     OnImageUpdated();    
 }
 
+//------------------------ Stimulus cache -----------------------
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Stimulus cache hits"), STAT_SciViStimulusCacheHits, STATGROUP_SciVi);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Stimulus cache misses"), STAT_SciViStimulusCacheMisses, STATGROUP_SciVi);
+DECLARE_DWORD_ACCUMULATOR_STAT(TEXT("Cached stimuli"), STAT_SciViStimulusCacheEntries, STATGROUP_SciVi);
+DECLARE_MEMORY_STAT(TEXT("Stimulus cache"), STAT_SciViStimulusCacheMemory, STATGROUP_SciVi);
+DECLARE_CYCLE_STAT(TEXT("AOI thumbnail"), STAT_SciViAOIThumbnail, STATGROUP_SciVi);
+
+static SIZE_T TextureBytes(const UTexture2D* texture)
+{
+    return texture ? (SIZE_T)texture->GetSizeX() * texture->GetSizeY() * sizeof(FColor) : 0;
+}
+
+void AStimulus::CacheStimulus(const FSHAHash& hash, UTexture2D* texture, TArray<uint8>&& pixels, float sx, float sy,
+    TArray<FAOI>&& newAOIs, FAOIGridIndex&& newAOIIndex)
+{
+    if (IsStimulusCached(hash))
+    {
+        texture_pool.Release(texture);
+        return;
+    }
+    FCachedStimulus& cached = stimulus_cache.Add(hash);
+    cached.texture = texture;
+    cached.sx = sx;
+    cached.sy = sy;
+    cached.AOIs = MoveTemp(newAOIs);
+    cached.AOIIndex = MoveTemp(newAOIIndex);
+    cached.pixels = MoveTemp(pixels);
+    cached.thumbnails.SetNum(cached.AOIs.Num());
+    stimulus_cache_lru.Add(hash);
+    AddCachedBytes(cached, TextureBytes(texture) + cached.pixels.Num());
+    SET_DWORD_STAT(STAT_SciViStimulusCacheEntries, stimulus_cache.Num());
+    ReleaseCachedStimuli();
+}
+
+void AStimulus::AddCachedBytes(FCachedStimulus& cached, SIZE_T bytes)
+{
+    cached.bytes += bytes;
+    stimulus_cache_bytes += bytes;
+    INC_MEMORY_STAT_BY(STAT_SciViStimulusCacheMemory, bytes);
+}
+
+bool AStimulus::ShowCachedStimulus(const FSHAHash& hash, bool count_lookup)
+{
+    auto cached = stimulus_cache.Find(hash);
+    if (!cached)
+    {
+        if (count_lookup)
+            SET_DWORD_STAT(STAT_SciViStimulusCacheMisses, ++stimulus_cache_misses);
+        return false;
+    }
+    if (count_lookup)
+        SET_DWORD_STAT(STAT_SciViStimulusCacheHits, ++stimulus_cache_hits);
+    stimulus_cache_lru.Remove(hash);
+    stimulus_cache_lru.Add(hash);
+    shown_hash = hash;
+    updateDynTex(cached->texture, cached->sx, cached->sy, cached->AOIs, cached->AOIIndex);
+    UE_LOG(LogTemp, Display, TEXT("Stimulus cache: %d stimuli, %.1f MB, %u hits, %u misses, %.1f MB of live textures"),
+        stimulus_cache.Num(), stimulus_cache_bytes / (1024.0 * 1024.0), stimulus_cache_hits, stimulus_cache_misses,
+        texture_pool.GetLiveBytes() / (1024.0 * 1024.0));
+    return true;
+}
+
+UTexture2D* AStimulus::AcquireTexture(int32 width, int32 height)
+{
+    texture_pool.memory_ceiling = (SIZE_T)FMath::Max(TextureMemoryMB, 0) * 1024 * 1024;
+    while (texture_pool.WouldExceed(width, height) && ReleaseLeastRecentStimulus())
+        ;
+    if (texture_pool.WouldExceed(width, height))
+        UE_LOG(LogTemp, Warning, TEXT("Stimulus textures: %.1f MB in use, above the %d MB ceiling"),
+            texture_pool.GetUsedBytes() / (1024.0 * 1024.0), TextureMemoryMB);
+    return texture_pool.Acquire(width, height);
+}
+
+UTexture2D* AStimulus::AcquireAtlasPage()
+{
+    UTexture2D* page = AcquireTexture(AOIAtlas_PageSize, AOIAtlas_PageSize);
+    if (!page)
+        return nullptr;
+    //the gaps between the thumbnails must be transparent, a reused page is cleared too
+    TArray<uint8> clear;
+    clear.SetNumZeroed(AOIAtlas_PageSize * AOIAtlas_PageSize * sizeof(FColor));
+    URTHelpers::updateTexture2DFromBGRA(page, clear);
+    return page;
+}
+
+FAOIThumbnail AStimulus::GetAOIThumbnail(const FAOI* aoi)
+{
+    TArray<FAOIThumbnail> thumbnails;
+    GetAOIThumbnails({ aoi }, thumbnails);
+    return thumbnails[0];
+}
+
+//AOI crop, its rows are copied to the staging buffer of the upload on a worker thread
+struct FAOICrop
+{
+    FIntPoint start;//in the stimulus
+    FIntPoint size;
+    FIntPoint position;//in the texture
+    int32 upload;
+};
+
+//all the crops going to one texture, uploaded by one UpdateTextureRegions.
+//The staging buffer has the layout of the texture rows first_row..end_row, so the regions keep their positions.
+struct FAOIUpload
+{
+    UTexture2D* texture;
+    int32 first_row;
+    int32 end_row;
+    TArray<FUpdateTextureRegion2D> regions;
+    uint8* staging = nullptr;
+};
+
+void AStimulus::GetAOIThumbnails(const TArray<const FAOI*>& aois, TArray<FAOIThumbnail>& out_thumbnails)
+{
+    out_thumbnails.Reset(aois.Num());
+    auto cached = stimulus_cache.Find(shown_hash);
+    if (!cached || !cached->texture)
+    {
+        out_thumbnails.SetNum(aois.Num());
+        return;
+    }
+
+    SCOPE_CYCLE_COUNTER(STAT_SciViAOIThumbnail);
+    //packing and texture allocation are serial, they are cheap compared to the pixel copies
+    const int32 width = cached->texture->GetSizeX();
+    const int32 height = cached->texture->GetSizeY();
+    TArray<FAOICrop> crops;
+    TArray<FAOIUpload> uploads;
+    int32 page_upload = INDEX_NONE;
+    for (auto aoi : aois)
+    {
+        int aoi_index = aoi - AOIs.GetData();
+        if (aoi_index < 0 || aoi_index >= cached->thumbnails.Num() || cached->thumbnails[aoi_index].texture)
+            continue;
+        FAOIThumbnail& thumbnail = cached->thumbnails[aoi_index];
+        //the bbox is clipped to the stimulus, an AOI outside of it has no thumbnail
+        FAOICrop crop;
+        crop.start = FIntPoint(FMath::Max((int)aoi->bbox.Min.X, 0), FMath::Max((int)aoi->bbox.Min.Y, 0));
+        crop.size = FIntPoint(FMath::Min((int)aoi->bbox.Min.X + (int)aoi->bbox.GetSize().X, width) - crop.start.X,
+                              FMath::Min((int)aoi->bbox.Min.Y + (int)aoi->bbox.GetSize().Y, height) - crop.start.Y);
+        if (crop.size.X <= 0 || crop.size.Y <= 0)
+            continue;
+
+        crop.position = FIntPoint(0, 0);
+        if (!FAtlasPacker::FitsInPage(crop.size))
+        {
+            thumbnail.texture = AcquireTexture(crop.size.X, crop.size.Y);
+            if (!thumbnail.texture)
+                continue;
+            //a new texture has no resource to update the regions of yet
+            if (!thumbnail.texture->Resource)
+                thumbnail.texture->UpdateResource();
+            thumbnail.uv = FBox2D(FVector2D(0.0f, 0.0f), FVector2D(1.0f, 1.0f));
+            cached->atlas_pages.Add(thumbnail.texture);
+            AddCachedBytes(*cached, TextureBytes(thumbnail.texture));
+            crop.upload = uploads.Add(FAOIUpload{ thumbnail.texture, 0, crop.size.Y });
+        }
+        else
+        {
+            if (cached->atlas_page == INDEX_NONE || !cached->packer.Add(crop.size, crop.position))
+            {
+                UTexture2D* new_page = AcquireAtlasPage();
+                if (!new_page)
+                    continue;
+                cached->atlas_page = cached->atlas_pages.Add(new_page);
+                cached->packer.Reset();
+                cached->packer.Add(crop.size, crop.position);
+                AddCachedBytes(*cached, TextureBytes(new_page));
+                page_upload = INDEX_NONE;
+            }
+            if (page_upload == INDEX_NONE)
+                page_upload = uploads.Add(FAOIUpload{ cached->atlas_pages[cached->atlas_page], crop.position.Y, crop.position.Y });
+            crop.upload = page_upload;
+            thumbnail.texture = cached->atlas_pages[cached->atlas_page];
+            thumbnail.uv = FBox2D(FVector2D(crop.position) / AOIAtlas_PageSize, FVector2D(crop.position + crop.size) / AOIAtlas_PageSize);
+        }
+        thumbnail.size = FVector2D(crop.size);
+        FAOIUpload& upload = uploads[crop.upload];
+        upload.first_row = FMath::Min(upload.first_row, crop.position.Y);
+        upload.end_row = FMath::Max(upload.end_row, crop.position.Y + crop.size.Y);
+        crops.Add(crop);
+    }
+
+    for (auto& upload : uploads)
+        upload.staging = static_cast<uint8*>(FMemory::Malloc((SIZE_T)(upload.end_row - upload.first_row) * upload.texture->GetSizeX() * sizeof(FColor)));
+    for (auto& crop : crops)
+    {
+        FAOIUpload& upload = uploads[crop.upload];
+        upload.regions.Add(FUpdateTextureRegion2D(crop.position.X, crop.position.Y, crop.position.X, crop.position.Y - upload.first_row,
+            crop.size.X, crop.size.Y));
+    }
+    //the crops don't overlap in the staging buffers, every one is copied by a single worker
+    const uint8* pixels = cached->pixels.GetData();
+    ParallelFor(crops.Num(), [&crops, &uploads, pixels, width](int32 i)
+    {
+        const FAOICrop& crop = crops[i];
+        const FAOIUpload& upload = uploads[crop.upload];
+        const SIZE_T pitch = (SIZE_T)upload.texture->GetSizeX() * sizeof(FColor);
+        const SIZE_T row_size = crop.size.X * sizeof(FColor);
+        uint8* dst = upload.staging + (crop.position.Y - upload.first_row) * pitch + crop.position.X * sizeof(FColor);
+        const uint8* src = pixels + ((SIZE_T)crop.start.Y * width + crop.start.X) * sizeof(FColor);
+        for (int y = 0; y < crop.size.Y; ++y, dst += pitch, src += width * sizeof(FColor))
+            FMemory::Memcpy(dst, src, row_size);
+    });
+
+    //one upload per texture, the staging buffer and the regions are freed on the render thread
+    for (auto& upload : uploads)
+    {
+        auto regions = new FUpdateTextureRegion2D[upload.regions.Num()];
+        FMemory::Memcpy(regions, upload.regions.GetData(), upload.regions.Num() * sizeof(FUpdateTextureRegion2D));
+        upload.texture->UpdateTextureRegions(0, upload.regions.Num(), regions, upload.texture->GetSizeX() * sizeof(FColor), sizeof(FColor),
+            upload.staging, [](uint8* data, const FUpdateTextureRegion2D* regions)
+            {
+                FMemory::Free(data);
+                delete[] regions;
+            });
+    }
+
+    for (auto aoi : aois)
+    {
+        int aoi_index = aoi - AOIs.GetData();
+        out_thumbnails.Add(aoi_index >= 0 && aoi_index < cached->thumbnails.Num() ? cached->thumbnails[aoi_index] : FAOIThumbnail());
+    }
+}
+
+bool AStimulus::ReleaseLeastRecentStimulus()
+{
+    //neither the shown stimulus nor the one cached last, it may be about to be shown
+    for (int i = 0; i < stimulus_cache_lru.Num() - 1; ++i)
+    {
+        FSHAHash hash = stimulus_cache_lru[i];
+        if (hash == shown_hash)
+            continue;
+        //the textures aren't referenced anymore: the walls were cleared when another stimulus was shown
+        FCachedStimulus cached;
+        stimulus_cache.RemoveAndCopyValue(hash, cached);
+        stimulus_cache_lru.RemoveAt(i);
+        texture_pool.Release(cached.texture);
+        for (auto page : cached.atlas_pages)
+            texture_pool.Release(page);
+        stimulus_cache_bytes -= cached.bytes;
+        DEC_MEMORY_STAT_BY(STAT_SciViStimulusCacheMemory, cached.bytes);
+        SET_DWORD_STAT(STAT_SciViStimulusCacheEntries, stimulus_cache.Num());
+        return true;
+    }
+    return false;
+}
+
+void AStimulus::ReleaseCachedStimuli()
+{
+    const SIZE_T budget = (SIZE_T)FMath::Max(StimulusCacheMB, 0) * 1024 * 1024;
+    while (stimulus_cache_bytes > budget && ReleaseLeastRecentStimulus())
+        ;
+}
+
 void AStimulus::BindInformant(ABaseInformant* _informant)
 {
     informant = _informant;
@@ -183,7 +442,7 @@ void AStimulus::ClearSelectedAOIs()
     for (auto selected_aoi : SelectedAOIs) 
     {
         int aoi_index = selected_aoi - AOIs.GetData();
-        SendGazeToSciVi(gaze, uv, aoi_index, TEXT("SELECT"));//this unselect selected in sciVi
+        SendGazeToSciVi(gaze, uv, aoi_index, ESciViGazeAction::Select);//this unselect selected in sciVi
     }
     SelectedAOIs.Empty();
     UpdateContours();
@@ -197,7 +456,7 @@ void AStimulus::OnInFocus(const FGaze& gaze, const FHitResult& hitPoint)
         int currentAOIIndex = -1;
         if (!informant->MC_Right->bHiddenInGame)
             auto lookedAOI = findAOI(FVector2D(uv.X * image->GetSizeX(), uv.Y * image->GetSizeY()), currentAOIIndex);
-        SendGazeToSciVi(gaze, uv, currentAOIIndex, TEXT("LOOKAT"));
+        SendGazeToSciVi(gaze, uv, currentAOIIndex, ESciViGazeAction::LookAt);
     }
 }
 
@@ -261,11 +520,11 @@ void AStimulus::OnTriggerReleased(const FHitResult& hitPoint)
             if (selectedAOI)
             {
                 toggleSelectedAOI(selectedAOI);
-                SendGazeToSciVi(gaze, m_laser, currentAOIIndex, TEXT("SELECT"));
+                SendGazeToSciVi(gaze, m_laser, currentAOIIndex, ESciViGazeAction::Select);
             }
         }
         UpdateContours();
-        SendGazeToSciVi(gaze, m_laser, currentAOIIndex, TEXT("R_RELD"));
+        SendGazeToSciVi(gaze, m_laser, currentAOIIndex, ESciViGazeAction::RReld);
     }
 }
 
@@ -286,7 +545,7 @@ void AStimulus::OnImageUpdated()
             int currentAOIIndex = -1;
             if (!informant->MC_Right->bHiddenInGame)
                 auto lookedAOI = findAOI(FVector2D(uv.X * image->GetSizeX(), uv.Y * image->GetSizeY()), currentAOIIndex);
-            SendGazeToSciVi(gaze, uv, currentAOIIndex, TEXT("IMG_UP"));
+            SendGazeToSciVi(gaze, uv, currentAOIIndex, ESciViGazeAction::ImgUp);
         }
     }
 }
@@ -355,21 +614,25 @@ void AStimulus::drawContour(UCanvas* cvs, int32 w, int32 h)
         fillCircle(cvs, FVector2D(m_customCalibTarget.location.X * image->GetSizeX(), m_customCalibTarget.location.Y * image->GetSizeY()), m_customCalibTarget.radius, FLinearColor(0, 0, 0, 1));
 }
 
-void AStimulus::SendGazeToSciVi(const FGaze& gaze, FVector2D& uv, int AOI_index, const TCHAR* Id)
+void AStimulus::SendGazeToSciVi(const FGaze& gaze, FVector2D& uv, int AOI_index, ESciViGazeAction action)
 {
     auto GM = GetWorld()->GetAuthGameMode<AReadingTrackerGameMode>();
-    //Send message to scivi
-    auto json = FString::Printf(TEXT("\"Gaze\": {\"uv\": [%f, %f]," 
-                                    "\"origin\": [%f, %f, %f],"
-                                    "\"direction\": [%F, %F, %F],"
-                                    "\"lpdmm\": %F, \"rpdmm\": %F,"
-                                    "\"cf\": %F, \"AOI_index\": %i,"
-                                    "\"Action\": \"%s\"}"),
-        uv.X, uv.Y,
-        gaze.origin.X, gaze.origin.Y, gaze.origin.Z,
-        gaze.direction.X, gaze.direction.Y, gaze.direction.Z,
-        gaze.left_pupil_diameter_mm, gaze.right_pupil_diameter_mm, gaze.cf, AOI_index, Id);
-    GM->Broadcast(json);
+    //Send message to scivi, the game mode encodes it as JSON or as binary record for each client
+    FSciViGazeRecord record;
+    record.action = (uint8)action;
+    record.timestamp = gaze.timestamp;
+    record.uv[0] = uv.X; record.uv[1] = uv.Y;
+    record.origin[0] = gaze.origin.X; record.origin[1] = gaze.origin.Y; record.origin[2] = gaze.origin.Z;
+    record.direction[0] = gaze.direction.X; record.direction[1] = gaze.direction.Y; record.direction[2] = gaze.direction.Z;
+    record.left_pupil_diameter_mm = gaze.left_pupil_diameter_mm;
+    record.left_pupil_openness = gaze.left_pupil_openness;
+    record.right_pupil_diameter_mm = gaze.right_pupil_diameter_mm;
+    record.right_pupil_openness = gaze.right_pupil_openness;
+    record.cf = gaze.cf;
+    record.AOI_index = AOI_index;
+    //only plain gaze samples may be dropped for a slow client, selections and other actions are events
+    auto message_class = action == ESciViGazeAction::LookAt ? EWSMessageClass::Gaze : EWSMessageClass::Event;
+    GM->BroadcastGaze(record, EWSLane::Realtime, message_class);
 }
 
 void AStimulus::OnClicked_CreateList()
@@ -399,7 +662,7 @@ FVector2D AStimulus::sceneToBillboard(const FVector& pos) const
 FAOI* AStimulus::findAOI(const FVector2D& pt, int& out_index) const
 {
     out_index = -1;
-    for(int i = 0; i < AOIs.Num(); ++i)
+    for (int i : AOIIndex.Candidates(pt))
         if (AOIs[i].IsPointInside(pt))
         {
             out_index = i;
@@ -7,6 +7,8 @@
 #include "Engine/Canvas.h"
 #include "IImageWrapper.h"
 #include "ReadingTrackerGameMode.h"
+#include "Private/AtlasPacker.h"
+#include "Private/TexturePool.h"
 #include "Stimulus.generated.h"
 
 //#define EYE_DEBUG
@@ -23,7 +25,7 @@ public:
     //----------------- API ---------------------
     AStimulus();
     virtual void BeginPlay() override;
-    void updateDynTex(UTexture2D* texture, float sx, float sy, const TArray<FAOI>& newAOIs);
+    void updateDynTex(UTexture2D* texture, float sx, float sy, const TArray<FAOI>& newAOIs, const FAOIGridIndex& newAOIIndex);
     void BindInformant(class ABaseInformant* _informant);
     void UpdateContours();
     void ClearSelectedAOIs();
@@ -35,6 +37,7 @@ public:
     void OnImageUpdated();
 
     TArray<FAOI> AOIs;
+    FAOIGridIndex AOIIndex;
     TArray<const FAOI*> SelectedAOIs;
 
     //UFUNCTION(BlueprintCallable)
@@ -53,11 +56,30 @@ public:
 
     UPROPERTY(EditAnywhere, BlueprintReadOnly, Category=UI)
     class UWidgetComponent* CreateListButton;
+
+    //----------------- Stimulus cache ----------------
+    //stimuli are kept ready to show by the SHA1 of their image file, the least recently shown are released above StimulusCacheMB
+    UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Cache)
+    int StimulusCacheMB = 1024;
+    //ceiling of the stimulus and AOI thumbnail textures, the least recently shown stimuli are released to stay below it, 0 - no ceiling
+    UPROPERTY(EditAnywhere, BlueprintReadonly, Category = Cache)
+    int TextureMemoryMB = 2048;
+    //transient BGRA texture from the pool, it's released with the cached stimulus it's given to
+    UTexture2D* AcquireTexture(int32 width, int32 height);
+    //takes the ownership of the texture, its BGRA pixels are kept for the AOI thumbnails, the texture goes back to the pool if the hash is cached already
+    void CacheStimulus(const FSHAHash& hash, UTexture2D* texture, TArray<uint8>&& pixels, float sx, float sy,
+        TArray<FAOI>&& newAOIs, FAOIGridIndex&& newAOIIndex);
+    //thumbnail of an AOI of the shown stimulus, it's cropped on the first request
+    FAOIThumbnail GetAOIThumbnail(const FAOI* aoi);
+    //thumbnails of several AOIs, the ones not cropped yet are cropped in parallel and uploaded once per texture
+    void GetAOIThumbnails(const TArray<const FAOI*>& aois, TArray<FAOIThumbnail>& out_thumbnails);
+    bool IsStimulusCached(const FSHAHash& hash) const { return stimulus_cache.Contains(hash); }
+    bool ShowCachedStimulus(const FSHAHash& hash, bool count_lookup = true);
     //----------------- Private API -----------------
 protected:
     UFUNCTION()
     void OnClicked_CreateList();
-    void SendGazeToSciVi(const struct FGaze& gaze, FVector2D& uv, int AOI_index, const TCHAR* Id);
+    void SendGazeToSciVi(const struct FGaze& gaze, FVector2D& uv, int AOI_index, ESciViGazeAction action);
 
     FVector billboardToScene(const FVector2D& pos) const;
     FVector2D sceneToBillboard(const FVector& pos) const;
@@ -75,6 +97,32 @@ protected:
 
     class ABaseInformant* informant = nullptr;
     FVector2D m_laser;
+
+    struct FCachedStimulus
+    {
+        UTexture2D* texture = nullptr;
+        float sx = 1.0f;
+        float sy = 1.0f;
+        TArray<FAOI> AOIs;
+        FAOIGridIndex AOIIndex;
+        TArray<uint8> pixels;//BGRA copy of the texture
+        TArray<FAOIThumbnail> thumbnails;//texture is null until the AOI is cropped
+        TArray<UTexture2D*> atlas_pages;//and the thumbnails larger than a page
+        int32 atlas_page = INDEX_NONE;//page being filled
+        FAtlasPacker packer;
+        SIZE_T bytes = 0;
+    };
+    TMap<FSHAHash, FCachedStimulus> stimulus_cache;
+    TArray<FSHAHash> stimulus_cache_lru;//the least recently shown first
+    SIZE_T stimulus_cache_bytes = 0;
+    FSHAHash shown_hash;//never released while it's shown
+    uint32 stimulus_cache_hits = 0;
+    uint32 stimulus_cache_misses = 0;
+    void ReleaseCachedStimuli();
+    bool ReleaseLeastRecentStimulus();
+    FStimulusTexturePool texture_pool;
+    UTexture2D* AcquireAtlasPage();
+    void AddCachedBytes(FCachedStimulus& cached, SIZE_T bytes);
    
 
     //dynamic texture
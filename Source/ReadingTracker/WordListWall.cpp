@@ -81,17 +81,22 @@ void AWordListWall::SetWallName(const FString& new_name)
 	}
 }
 
-void AWordListWall::AddAOI(const FAOI* aoi)
+void AWordListWall::AddAOI(const FAOI* aoi, const FAOIThumbnail& thumbnail)
 {
 	auto list = Cast<UScrollBox>(List->GetWidget()->GetWidgetFromName(TEXT("List")));
 	auto entry_name = FName(aoi->name + TEXT("_Entry"));
 	//if list doesnt contains an entry then insert
 
-	if (IsValid(aoi->image) && !list->GetAllChildren().ContainsByPredicate([entry_name](UWidget* widget) {return widget->GetFName() == entry_name; }))
+	if (IsValid(thumbnail.texture) && !list->GetAllChildren().ContainsByPredicate([entry_name](UWidget* widget) {return widget->GetFName() == entry_name; }))
 	{
 		auto entry = UUserWidget::CreateWidgetInstance(*GetWorld(), EntryWidgetClass, entry_name);
 		auto image = Cast<UImage>(entry->GetWidgetFromName(TEXT("AOI_Image")));
-		image->SetBrushFromTexture(aoi->image, true);
+		//the thumbnail is a region of the stimulus atlas page
+		FSlateBrush brush;
+		brush.SetResourceObject(thumbnail.texture);
+		brush.ImageSize = thumbnail.size;
+		brush.SetUVRegion(thumbnail.uv);
+		image->SetBrush(brush);
 		auto btnRemoveEntry = Cast<URichButton>(entry->GetWidgetFromName(TEXT("btnRemoveEntry")));
 		btnRemoveEntry->OnClicked.AddDynamic(this, &AWordListWall::OnClicked_RemoveEntry);
 		list->AddChild(entry);
@@ -31,7 +31,7 @@ public:
 	void SetWallWidth(float width);
 	FORCEINLINE const FString& GetWallName() const { return name; }
 
-	void AddAOI(const FAOI* aoi);
+	void AddAOI(const FAOI* aoi, const FAOIThumbnail& thumbnail);
 	void ClearList();
 
 	// -------------------- Properties ----------------
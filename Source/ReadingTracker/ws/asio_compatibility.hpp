@@ -26,6 +26,11 @@ namespace SimpleWeb {
 } // namespace SimpleWeb
 #endif
 
+// io_uring is only used by asio 1.21 and newer, older versions ignore the macro and keep using epoll
+#if(defined(ASIO_HAS_IO_URING) && ASIO_VERSION < 102100) || (defined(BOOST_ASIO_HAS_IO_URING) && BOOST_ASIO_VERSION < 102100)
+#error "the io_uring backend needs asio 1.21.0 or newer"
+#endif
+
 namespace SimpleWeb {
 #if(ASIO_STANDALONE && ASIO_VERSION >= 101300) || BOOST_ASIO_VERSION >= 101300
   using io_context = asio::io_context;
@@ -53,6 +58,19 @@ namespace SimpleWeb {
   inline asio::executor_work_guard<io_context::executor_type> make_work_guard(io_context &context) {
     return asio::make_work_guard(context);
   }
+  using strand = asio::strand<asio::ip::tcp::socket::executor_type>;
+  template <typename socket_type>
+  strand make_strand(socket_type &socket) {
+    return strand(socket.lowest_layer().get_executor());
+  }
+  template <typename handler_type>
+  auto bind_strand(strand &strand, handler_type &&handler) -> decltype(asio::bind_executor(strand, std::forward<handler_type>(handler))) {
+    return asio::bind_executor(strand, std::forward<handler_type>(handler));
+  }
+  template <typename handler_type>
+  inline void post(strand &strand, handler_type &&handler) {
+    asio::post(strand, std::forward<handler_type>(handler));
+  }
 #else
   using io_context = asio::io_service;
   using resolver_results = asio::ip::tcp::resolver::iterator;
@@ -79,6 +97,19 @@ namespace SimpleWeb {
   inline io_context::work make_work_guard(io_context &context) {
     return io_context::work(context);
   }
+  using strand = io_context::strand;
+  template <typename socket_type>
+  strand make_strand(socket_type &socket) {
+    return strand(socket.lowest_layer().get_io_service());
+  }
+  template <typename handler_type>
+  auto bind_strand(strand &strand, handler_type &&handler) -> decltype(strand.wrap(std::forward<handler_type>(handler))) {
+    return strand.wrap(std::forward<handler_type>(handler));
+  }
+  template <typename handler_type>
+  inline void post(strand &strand, handler_type &&handler) {
+    strand.post(std::forward<handler_type>(handler));
+  }
 #endif
 } // namespace SimpleWeb
 
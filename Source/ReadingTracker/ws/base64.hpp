@@ -0,0 +1,368 @@
+#ifndef SIMPLE_WEB_BASE64_HPP
+#define SIMPLE_WEB_BASE64_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMPLE_WEB_BASE64_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(SIMPLE_WEB_BASE64_X86) && !defined(_MSC_VER)
+#define SIMPLE_WEB_BASE64_TARGET(isa) __attribute__((target(isa)))
+#else
+#define SIMPLE_WEB_BASE64_TARGET(isa)
+#endif
+
+namespace SimpleWeb {
+  /// Base64 (RFC 4648, standard alphabet) with SSSE3/SSE4.1 and AVX2 kernels chosen at run time and a scalar fallback.
+  /// The characters can be 8 or 16 bit wide, so UTF-16 text is encoded and decoded in place.
+  namespace base64 {
+    /// Number of characters encode() writes for size bytes.
+    inline std::size_t encoded_size(std::size_t size) noexcept {
+      return (size + 2) / 3 * 4;
+    }
+
+    /// Upper bound of the bytes decode() writes for size characters.
+    inline std::size_t decoded_size(std::size_t size) noexcept {
+      return (size + 3) / 4 * 3;
+    }
+
+    namespace detail {
+      static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+      /// 6-bit values of the characters, 0xff for the characters that aren't in the alphabet.
+      struct DecodeTable {
+        unsigned char values[256];
+        DecodeTable() noexcept {
+          for(auto &value : values)
+            value = 0xff;
+          for(unsigned char i = 0; i < 64; ++i)
+            values[static_cast<unsigned char>(alphabet[i])] = i;
+        }
+      };
+      inline const unsigned char *decode_table() noexcept {
+        static const DecodeTable table;
+        return table.values;
+      }
+
+      template <typename char_type>
+      inline unsigned char decode_value(char_type c) noexcept {
+        auto code = static_cast<typename std::make_unsigned<char_type>::type>(c);
+        return code < 256 ? decode_table()[code] : 0xff;
+      }
+
+      template <typename char_type>
+      std::size_t encode_scalar(const unsigned char *in, std::size_t size, char_type *out) noexcept {
+        auto start = out;
+        for(; size >= 3; size -= 3, in += 3) {
+          std::uint32_t triple = (std::uint32_t(in[0]) << 16) | (std::uint32_t(in[1]) << 8) | in[2];
+          *out++ = static_cast<char_type>(alphabet[(triple >> 18) & 0x3f]);
+          *out++ = static_cast<char_type>(alphabet[(triple >> 12) & 0x3f]);
+          *out++ = static_cast<char_type>(alphabet[(triple >> 6) & 0x3f]);
+          *out++ = static_cast<char_type>(alphabet[triple & 0x3f]);
+        }
+        if(size > 0) {
+          std::uint32_t triple = std::uint32_t(in[0]) << 16;
+          if(size == 2)
+            triple |= std::uint32_t(in[1]) << 8;
+          *out++ = static_cast<char_type>(alphabet[(triple >> 18) & 0x3f]);
+          *out++ = static_cast<char_type>(alphabet[(triple >> 12) & 0x3f]);
+          *out++ = static_cast<char_type>(size == 2 ? alphabet[(triple >> 6) & 0x3f] : '=');
+          *out++ = static_cast<char_type>('=');
+        }
+        return static_cast<std::size_t>(out - start);
+      }
+
+      /// Decodes whole quads, the last one may be padded or cut short. Returns false on invalid input.
+      template <typename char_type>
+      bool decode_scalar(const char_type *in, std::size_t size, unsigned char *out, std::size_t &out_size) noexcept {
+        auto start = out;
+        while(size >= 4 && in[3] != static_cast<char_type>('=')) {
+          auto a = decode_value(in[0]), b = decode_value(in[1]), c = decode_value(in[2]), d = decode_value(in[3]);
+          if((a | b | c | d) & 0xc0)
+            return false;
+          std::uint32_t triple = (std::uint32_t(a) << 18) | (std::uint32_t(b) << 12) | (std::uint32_t(c) << 6) | d;
+          *out++ = static_cast<unsigned char>(triple >> 16);
+          *out++ = static_cast<unsigned char>(triple >> 8);
+          *out++ = static_cast<unsigned char>(triple);
+          in += 4;
+          size -= 4;
+        }
+        // Tail: "xx==", "xxx=", "xx" or "xxx" without padding
+        if(size > 0) {
+          std::size_t chars = size;
+          if(size == 4)
+            chars = in[2] == static_cast<char_type>('=') ? 2 : 3;
+          if(chars < 2 || chars > 3 || (size == 4 && chars == 2 && in[3] != static_cast<char_type>('=')))
+            return false;
+          auto a = decode_value(in[0]), b = decode_value(in[1]);
+          auto c = chars == 3 ? decode_value(in[2]) : static_cast<unsigned char>(0);
+          if((a | b | c) & 0xc0)
+            return false;
+          std::uint32_t triple = (std::uint32_t(a) << 18) | (std::uint32_t(b) << 12) | (std::uint32_t(c) << 6);
+          *out++ = static_cast<unsigned char>(triple >> 16);
+          if(chars == 3)
+            *out++ = static_cast<unsigned char>(triple >> 8);
+        }
+        out_size = static_cast<std::size_t>(out - start);
+        return true;
+      }
+
+#ifdef SIMPLE_WEB_BASE64_X86
+      /// 0 - scalar, 1 - SSSE3 and SSE4.1, 2 - AVX2
+      inline int simd_level() noexcept {
+        static const int level = [] {
+#ifdef _MSC_VER
+          int info[4];
+          __cpuid(info, 0);
+          int max_leaf = info[0];
+          __cpuid(info, 1);
+          bool ssse3 = (info[2] & (1 << 9)) != 0, sse41 = (info[2] & (1 << 19)) != 0;
+          bool os_avx = (info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6) == 6;
+          bool avx2 = false;
+          if(max_leaf >= 7 && os_avx) {
+            __cpuidex(info, 7, 0);
+            avx2 = (info[1] & (1 << 5)) != 0;
+          }
+#else
+          __builtin_cpu_init();
+          bool ssse3 = __builtin_cpu_supports("ssse3"), sse41 = __builtin_cpu_supports("sse4.1");
+          bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+          return avx2 ? 2 : (ssse3 && sse41) ? 1 : 0;
+        }();
+        return level;
+      }
+
+      // Kernels of Wojciech Muła and Alfred Klomp: the 6-bit values are spread into bytes with multiplies
+      // and translated to characters by pshufb lookups of the offset per character range.
+
+      SIMPLE_WEB_BASE64_TARGET("ssse3,sse4.1")
+      inline __m128i encode_reshuffle(__m128i in) noexcept {
+        in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+        const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+        const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+        const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+        const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+        return _mm_or_si128(t1, t3);
+      }
+
+      SIMPLE_WEB_BASE64_TARGET("ssse3,sse4.1")
+      inline __m128i encode_translate(__m128i in) noexcept {
+        const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+        __m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+        indices = _mm_sub_epi8(indices, _mm_cmpgt_epi8(in, _mm_set1_epi8(25)));
+        return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+      }
+
+      /// Translates 16 characters to 6-bit values and packs them into the first 12 bytes, false on invalid characters.
+      SIMPLE_WEB_BASE64_TARGET("ssse3,sse4.1")
+      inline bool decode_translate(__m128i &str) noexcept {
+        const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+        const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m128i mask_2f = _mm_set1_epi8(0x2f);
+        const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+        const __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+        const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+        const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+        if(!_mm_testz_si128(lo, hi))
+          return false;
+        const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(_mm_cmpeq_epi8(str, mask_2f), hi_nibbles));
+        str = _mm_add_epi8(str, roll);
+        const __m128i merge_ab_and_bc = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+        str = _mm_madd_epi16(merge_ab_and_bc, _mm_set1_epi32(0x00011000));
+        str = _mm_shuffle_epi8(str, _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+        return true;
+      }
+
+      template <typename char_type>
+      SIMPLE_WEB_BASE64_TARGET("ssse3,sse4.1")
+      inline __m128i load_chars(const char_type *in) noexcept {
+        if(sizeof(char_type) == 1)
+          return _mm_loadu_si128(reinterpret_cast<const __m128i *>(in));
+        // Characters above 0xff saturate to 0xff, which isn't in the alphabet either
+        return _mm_packus_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in)), _mm_loadu_si128(reinterpret_cast<const __m128i *>(in) + 1));
+      }
+
+      template <typename char_type>
+      SIMPLE_WEB_BASE64_TARGET("ssse3,sse4.1")
+      inline void store_chars(char_type *out, __m128i chars) noexcept {
+        if(sizeof(char_type) == 1)
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(out), chars);
+        else {
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm_unpacklo_epi8(chars, _mm_setzero_si128()));
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(out) + 1, _mm_unpackhi_epi8(chars, _mm_setzero_si128()));
+        }
+      }
+
+      /// Encodes blocks of 12 bytes while 16 bytes can be read, returns the bytes consumed.
+      template <typename char_type>
+      SIMPLE_WEB_BASE64_TARGET("ssse3,sse4.1")
+      std::size_t encode_sse(const unsigned char *in, std::size_t size, char_type *&out) noexcept {
+        std::size_t done = 0;
+        for(; size - done >= 16; done += 12, out += 16) {
+          __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done));
+          store_chars(out, encode_translate(encode_reshuffle(bytes)));
+        }
+        return done;
+      }
+
+      /// Decodes blocks of 16 characters while at least 8 more follow (the last 4 bytes of each 16-byte store
+      /// are overwritten later), returns the characters consumed or size + 1 on invalid input.
+      template <typename char_type>
+      SIMPLE_WEB_BASE64_TARGET("ssse3,sse4.1")
+      std::size_t decode_sse(const char_type *in, std::size_t size, unsigned char *&out) noexcept {
+        std::size_t done = 0;
+        for(; size - done >= 24; done += 16, out += 12) {
+          __m128i str = load_chars(in + done);
+          if(!decode_translate(str))
+            return size + 1;
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(out), str);
+        }
+        return done;
+      }
+
+      SIMPLE_WEB_BASE64_TARGET("avx2")
+      inline __m256i encode_translate_avx2(__m256i in) noexcept {
+        const __m256i shuffle = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                                 1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+        in = _mm256_shuffle_epi8(in, shuffle);
+        const __m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+        const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        const __m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+        const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        in = _mm256_or_si256(t1, t3);
+        const __m256i lut = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+                                             65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+        __m256i indices = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+        indices = _mm256_sub_epi8(indices, _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25)));
+        return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, indices));
+      }
+
+      template <typename char_type>
+      SIMPLE_WEB_BASE64_TARGET("avx2")
+      inline void store_chars_avx2(char_type *out, __m256i chars) noexcept {
+        if(sizeof(char_type) == 1)
+          _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), chars);
+        else {
+          _mm256_storeu_si256(reinterpret_cast<__m256i *>(out), _mm256_cvtepu8_epi16(_mm256_castsi256_si128(chars)));
+          _mm256_storeu_si256(reinterpret_cast<__m256i *>(out) + 1, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(chars, 1)));
+        }
+      }
+
+      /// Encodes blocks of 24 bytes, each 128-bit lane takes 12 of them.
+      template <typename char_type>
+      SIMPLE_WEB_BASE64_TARGET("avx2")
+      std::size_t encode_avx2(const unsigned char *in, std::size_t size, char_type *&out) noexcept {
+        std::size_t done = 0;
+        for(; size - done >= 28; done += 24, out += 32) {
+          __m256i bytes = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done))),
+                                                  _mm_loadu_si128(reinterpret_cast<const __m128i *>(in + done + 12)), 1);
+          store_chars_avx2(out, encode_translate_avx2(bytes));
+        }
+        return done;
+      }
+
+      template <typename char_type>
+      SIMPLE_WEB_BASE64_TARGET("avx2")
+      inline __m256i load_chars_avx2(const char_type *in) noexcept {
+        if(sizeof(char_type) == 1)
+          return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in));
+        // packus works per lane, the permute restores the order of the 64-bit halves
+        __m256i packed = _mm256_packus_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(in)), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(in) + 1));
+        return _mm256_permute4x64_epi64(packed, 0xd8);
+      }
+
+      /// Decodes blocks of 32 characters, each lane yields 12 bytes stored with 16-byte writes.
+      template <typename char_type>
+      SIMPLE_WEB_BASE64_TARGET("avx2")
+      std::size_t decode_avx2(const char_type *in, std::size_t size, unsigned char *&out) noexcept {
+        const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                                0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+        const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                                0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+        const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+                                                  0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+        const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                              2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+        const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+        std::size_t done = 0;
+        for(; size - done >= 40; done += 32, out += 24) {
+          __m256i str = load_chars_avx2(in + done);
+          const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+          const __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+          const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+          const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+          if(!_mm256_testz_si256(lo, hi))
+            return size + 1;
+          const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(_mm256_cmpeq_epi8(str, mask_2f), hi_nibbles));
+          str = _mm256_add_epi8(str, roll);
+          str = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+          str = _mm256_madd_epi16(str, _mm256_set1_epi32(0x00011000));
+          str = _mm256_shuffle_epi8(str, pack);
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(out), _mm256_castsi256_si128(str));
+          _mm_storeu_si128(reinterpret_cast<__m128i *>(out + 12), _mm256_extracti128_si256(str, 1));
+        }
+        return done;
+      }
+#endif
+    } // namespace detail
+
+    /// Writes encoded_size(size) characters to out, without a terminating zero. Returns the number of characters.
+    template <typename char_type>
+    std::size_t encode(const unsigned char *in, std::size_t size, char_type *out) noexcept {
+      static_assert(sizeof(char_type) <= 2, "8 or 16 bit characters");
+      auto start = out;
+      std::size_t done = 0;
+#ifdef SIMPLE_WEB_BASE64_X86
+      auto level = detail::simd_level();
+      if(level >= 2)
+        done = detail::encode_avx2(in, size, out);
+      if(level >= 1)
+        done += detail::encode_sse(in + done, size - done, out);
+#endif
+      out += detail::encode_scalar(in + done, size - done, out);
+      return static_cast<std::size_t>(out - start);
+    }
+
+    /// Decodes size characters to out, which must have room for decoded_size(size) bytes.
+    /// The input may be padded with '=' or not, it must not contain line breaks or other characters.
+    /// Returns false on invalid input, out_size is the number of bytes written otherwise.
+    template <typename char_type>
+    bool decode(const char_type *in, std::size_t size, unsigned char *out, std::size_t &out_size) noexcept {
+      static_assert(sizeof(char_type) <= 2, "8 or 16 bit characters");
+      auto start = out;
+      std::size_t done = 0;
+#ifdef SIMPLE_WEB_BASE64_X86
+      auto level = detail::simd_level();
+      if(level >= 2) {
+        done = detail::decode_avx2(in, size, out);
+        if(done > size)
+          return false;
+      }
+      if(level >= 1) {
+        auto sse_done = detail::decode_sse(in + done, size - done, out);
+        if(sse_done > size - done)
+          return false;
+        done += sse_done;
+      }
+#endif
+      std::size_t tail_size;
+      if(!detail::decode_scalar(in + done, size - done, out, tail_size))
+        return false;
+      out_size = static_cast<std::size_t>(out - start) + tail_size;
+      return true;
+    }
+  } // namespace base64
+} // namespace SimpleWeb
+
+#undef SIMPLE_WEB_BASE64_TARGET
+
+#endif /* SIMPLE_WEB_BASE64_HPP */
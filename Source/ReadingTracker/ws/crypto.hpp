@@ -8,7 +8,8 @@
 #include <string>
 #include <vector>
 
-#include <openssl/buffer.h>
+#include "base64.hpp"
+
 #include <openssl/evp.h>
 #include <openssl/md5.h>
 #include <openssl/sha.h>
@@ -29,63 +30,19 @@ namespace SimpleWeb {
     public:
       /// Returns Base64 encoded string from input string.
       static std::string encode(const std::string &input) noexcept {
-        std::string base64;
-
-        BIO *bio, *b64;
-        BUF_MEM *bptr = BUF_MEM_new();
-
-        b64 = BIO_new(BIO_f_base64());
-        BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-        bio = BIO_new(BIO_s_mem());
-        BIO_push(b64, bio);
-        BIO_set_mem_buf(b64, bptr, BIO_CLOSE);
-
-        // Write directly to base64-buffer to avoid copy
-        auto base64_length = static_cast<std::size_t>(round(4 * ceil(static_cast<double>(input.size()) / 3.0)));
-        base64.resize(base64_length);
-        bptr->length = 0;
-        bptr->max = base64_length + 1;
-        bptr->data = &base64[0];
-
-        if(BIO_write(b64, &input[0], static_cast<int>(input.size())) <= 0 || BIO_flush(b64) <= 0)
-          base64.clear();
-
-        // To keep &base64[0] through BIO_free_all(b64)
-        bptr->length = 0;
-        bptr->max = 0;
-        bptr->data = nullptr;
-
-        BIO_free_all(b64);
-
+        std::string base64(SimpleWeb::base64::encoded_size(input.size()), '\0');
+        SimpleWeb::base64::encode(reinterpret_cast<const unsigned char *>(input.data()), input.size(), &base64[0]);
         return base64;
       }
 
-      /// Returns Base64 decoded string from base64 input.
+      /// Returns Base64 decoded string from base64 input, an empty string if the input isn't valid Base64.
       static std::string decode(const std::string &base64) noexcept {
-        std::string ascii;
-
-        // Resize ascii, however, the size is a up to two bytes too large.
-        ascii.resize((6 * base64.size()) / 8);
-        BIO *b64, *bio;
-
-        b64 = BIO_new(BIO_f_base64());
-        BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-// TODO: Remove in 2022 or later
-#if(defined(OPENSSL_VERSION_NUMBER) && OPENSSL_VERSION_NUMBER < 0x1000214fL) || (defined(LIBRESSL_VERSION_NUMBER) && LIBRESSL_VERSION_NUMBER < 0x2080000fL)
-        bio = BIO_new_mem_buf(const_cast<char *>(&base64[0]), static_cast<int>(base64.size()));
-#else
-        bio = BIO_new_mem_buf(&base64[0], static_cast<int>(base64.size()));
-#endif
-        bio = BIO_push(b64, bio);
-
-        auto decoded_length = BIO_read(bio, &ascii[0], static_cast<int>(ascii.size()));
-        if(decoded_length > 0)
-          ascii.resize(static_cast<std::size_t>(decoded_length));
+        std::string ascii(SimpleWeb::base64::decoded_size(base64.size()), '\0');
+        std::size_t decoded_length;
+        if(SimpleWeb::base64::decode(base64.data(), base64.size(), reinterpret_cast<unsigned char *>(&ascii[0]), decoded_length))
+          ascii.resize(decoded_length);
         else
           ascii.clear();
-
-        BIO_free_all(b64);
-
         return ascii;
       }
     };
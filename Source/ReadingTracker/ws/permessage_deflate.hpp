@@ -0,0 +1,248 @@
+#ifndef SIMPLE_WEB_PERMESSAGE_DEFLATE_HPP
+#define SIMPLE_WEB_PERMESSAGE_DEFLATE_HPP
+
+#include "asio_compatibility.hpp"
+#include "utility.hpp"
+#include <algorithm>
+#include <array>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+namespace SimpleWeb {
+  /// permessage-deflate extension, see https://tools.ietf.org/html/rfc7692.
+  /// Holds the compressor and decompressor of one connection. The compressor and the decompressor
+  /// are independent, so compress() and decompress() may be called from different threads.
+  class PermessageDeflate {
+  public:
+    /// Server settings, see SocketServerBase::Config::permessage_deflate.
+    class Options {
+    public:
+      /// Set to true to accept permessage-deflate when offered by a client. Defaults to false.
+      bool enabled = false;
+      /// Reset the server's compressor after every message. Always used if the client asks for it.
+      bool server_no_context_takeover = false;
+      /// Ask clients to reset their compressor after every message.
+      bool client_no_context_takeover = false;
+      /// LZ77 window size (9 to 15) of the server's compressor. A smaller value is used if the client asks for it.
+      int server_max_window_bits = 15;
+      /// LZ77 window size (9 to 15) that clients are asked to use, if they support the client_max_window_bits parameter.
+      int client_max_window_bits = 15;
+      /// zlib compression level, 1 (fastest) to 9 (smallest). Defaults to Z_DEFAULT_COMPRESSION.
+      int compression_level = Z_DEFAULT_COMPRESSION;
+      /// Messages smaller than this number of bytes are sent uncompressed.
+      std::size_t compression_threshold = 0;
+    };
+
+    /// Parameters agreed on during the handshake.
+    class Parameters {
+    public:
+      bool server_no_context_takeover = false;
+      bool client_no_context_takeover = false;
+      int server_max_window_bits = 15;
+      int client_max_window_bits = 15;
+    };
+
+    /// Selects the first acceptable permessage-deflate offer in the Sec-WebSocket-Extensions header fields.
+    /// Returns false if there is none, otherwise parameters and the response header field value are set.
+    static bool negotiate(const CaseInsensitiveMultimap &header, const Options &options, Parameters &parameters, std::string &response) {
+      auto range = header.equal_range("Sec-WebSocket-Extensions");
+      for(auto it = range.first; it != range.second; ++it) {
+        const auto &value = it->second;
+        std::size_t offer_start = 0;
+        while(offer_start < value.size()) {
+          auto offer_end = value.find(',', offer_start);
+          if(offer_end == std::string::npos)
+            offer_end = value.size();
+          if(negotiate_offer(value.substr(offer_start, offer_end - offer_start), options, parameters, response))
+            return true;
+          offer_start = offer_end + 1;
+        }
+      }
+      return false;
+    }
+
+    PermessageDeflate(const Parameters &parameters, int compression_level) noexcept : parameters(parameters) {
+      deflate_stream.zalloc = Z_NULL;
+      deflate_stream.zfree = Z_NULL;
+      deflate_stream.opaque = Z_NULL;
+      // Negative window bits: raw deflate data without zlib header and trailer
+      deflate_ready = deflateInit2(&deflate_stream, compression_level, Z_DEFLATED, -parameters.server_max_window_bits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+
+      inflate_stream.zalloc = Z_NULL;
+      inflate_stream.zfree = Z_NULL;
+      inflate_stream.opaque = Z_NULL;
+      inflate_stream.next_in = Z_NULL;
+      inflate_stream.avail_in = 0;
+      // The largest window is always able to decompress, whatever window the client uses
+      inflate_ready = inflateInit2(&inflate_stream, -15) == Z_OK;
+    }
+
+    ~PermessageDeflate() noexcept {
+      if(deflate_ready)
+        deflateEnd(&deflate_stream);
+      if(inflate_ready)
+        inflateEnd(&inflate_stream);
+    }
+
+    PermessageDeflate(const PermessageDeflate &) = delete;
+    PermessageDeflate &operator=(const PermessageDeflate &) = delete;
+
+    /// Compresses one message into destination. Returns false on failure, the message should then be sent uncompressed.
+    /// The compressor is reset on failure, so later messages do not refer to data the client never received.
+    bool compress(const char *source, std::size_t size, asio::streambuf &destination) noexcept {
+      if(!deflate_ready)
+        return false;
+
+      // Compressed data is first written to a buffer that is reused for all messages of the connection,
+      // since the last 4 bytes produced have to be removed before the data is sent
+      deflate_stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(source));
+      deflate_stream.avail_in = static_cast<uInt>(size);
+      std::size_t compressed_size = 0;
+      do {
+        if(deflate_buffer.size() - compressed_size < 64)
+          deflate_buffer.resize(std::max<std::size_t>(deflate_buffer.size() * 2, size / 2 + 64));
+        deflate_stream.next_out = deflate_buffer.data() + compressed_size;
+        deflate_stream.avail_out = static_cast<uInt>(deflate_buffer.size() - compressed_size);
+        auto status = deflate(&deflate_stream, Z_SYNC_FLUSH);
+        if(status != Z_OK && status != Z_BUF_ERROR) {
+          deflateReset(&deflate_stream);
+          return false;
+        }
+        compressed_size = deflate_buffer.size() - deflate_stream.avail_out;
+      } while(deflate_stream.avail_out == 0);
+
+      if(parameters.server_no_context_takeover)
+        deflateReset(&deflate_stream);
+
+      // Z_SYNC_FLUSH ends the data with an empty stored block, 0x00 0x00 0xff 0xff, that is not sent (RFC 7692, section 7.2.1)
+      static const std::array<unsigned char, 4> tail{{0x00, 0x00, 0xff, 0xff}};
+      if(compressed_size < tail.size() || !std::equal(tail.begin(), tail.end(), deflate_buffer.data() + compressed_size - tail.size())) {
+        // The message is sent uncompressed, so the client never inflates these bytes: they must leave the LZ77 window too
+        deflateReset(&deflate_stream);
+        return false;
+      }
+      compressed_size -= tail.size();
+      auto buffer = destination.prepare(compressed_size);
+      std::copy_n(deflate_buffer.data(), compressed_size, static_cast<unsigned char *>(buffer.data()));
+      destination.commit(compressed_size);
+      return true;
+    }
+
+    /// Decompresses one message into destination.
+    /// Returns false if the data is invalid or if the decompressed message would be larger than max_size.
+    bool decompress(const char *source, std::size_t size, asio::streambuf &destination, std::size_t max_size) noexcept {
+      if(!inflate_ready)
+        return false;
+
+      // The removed empty stored block is appended again before decompression (RFC 7692, section 7.2.2)
+      static const std::array<unsigned char, 4> tail{{0x00, 0x00, 0xff, 0xff}};
+      inflate_ended = false;
+      bool success = inflate_chunk(reinterpret_cast<const unsigned char *>(source), size, destination, max_size) &&
+                     inflate_chunk(tail.data(), tail.size(), destination, max_size);
+      if(!success || inflate_ended || parameters.client_no_context_takeover)
+        inflateReset(&inflate_stream);
+      return success;
+    }
+
+  private:
+    Parameters parameters;
+    z_stream deflate_stream;
+    z_stream inflate_stream;
+    bool deflate_ready;
+    bool inflate_ready;
+    bool inflate_ended = false;
+    std::vector<unsigned char> deflate_buffer;
+
+    bool inflate_chunk(const unsigned char *source, std::size_t size, asio::streambuf &destination, std::size_t max_size) noexcept {
+      if(inflate_ended)
+        return true;
+      inflate_stream.next_in = const_cast<Bytef *>(source);
+      inflate_stream.avail_in = static_cast<uInt>(size);
+      // inflate() stops before all input is used only if the output buffer is full
+      do {
+        auto buffer = destination.prepare(std::max<std::size_t>(std::max<std::size_t>(size * 2, destination.size()), 4096));
+        inflate_stream.next_out = static_cast<Bytef *>(buffer.data());
+        inflate_stream.avail_out = static_cast<uInt>(buffer.size());
+        auto status = inflate(&inflate_stream, Z_SYNC_FLUSH);
+        if(status != Z_OK && status != Z_BUF_ERROR && status != Z_STREAM_END)
+          return false;
+        destination.commit(buffer.size() - inflate_stream.avail_out);
+        if(destination.size() > max_size)
+          return false;
+        if(status == Z_STREAM_END) {
+          inflate_ended = true;
+          break;
+        }
+      } while(inflate_stream.avail_out == 0);
+      return true;
+    }
+
+    static bool parse_window_bits(const std::string &value, int &window_bits) noexcept {
+      if(value.empty() || value.size() > 2 || !std::all_of(value.begin(), value.end(), [](char c) { return c >= '0' && c <= '9'; }))
+        return false;
+      window_bits = std::stoi(value);
+      // zlib does not support raw deflate with a window size of 8 bits
+      return window_bits >= 9 && window_bits <= 15;
+    }
+
+    static bool negotiate_offer(const std::string &offer, const Options &options, Parameters &parameters, std::string &response) {
+      auto attributes = HttpHeader::FieldValue::SemicolonSeparatedAttributes::parse(offer);
+      if(attributes.count("permessage-deflate") != 1)
+        return false;
+
+      Parameters result;
+      result.server_no_context_takeover = options.server_no_context_takeover;
+      result.client_no_context_takeover = options.client_no_context_takeover;
+      result.server_max_window_bits = options.server_max_window_bits;
+      bool client_max_window_bits_offered = false;
+      int client_max_window_bits = 15;
+      for(auto &attribute : attributes) {
+        if(attributes.count(attribute.first) != 1)
+          return false;
+        if(case_insensitive_equal(attribute.first, "permessage-deflate"))
+          continue;
+        else if(case_insensitive_equal(attribute.first, "server_no_context_takeover")) {
+          if(!attribute.second.empty())
+            return false;
+          result.server_no_context_takeover = true;
+        }
+        else if(case_insensitive_equal(attribute.first, "client_no_context_takeover")) {
+          if(!attribute.second.empty())
+            return false;
+        }
+        else if(case_insensitive_equal(attribute.first, "server_max_window_bits")) {
+          int window_bits;
+          if(!parse_window_bits(attribute.second, window_bits))
+            return false;
+          result.server_max_window_bits = std::min(result.server_max_window_bits, window_bits);
+        }
+        else if(case_insensitive_equal(attribute.first, "client_max_window_bits")) {
+          if(!attribute.second.empty() && !parse_window_bits(attribute.second, client_max_window_bits))
+            return false;
+          client_max_window_bits_offered = true;
+        }
+        else
+          return false;
+      }
+      result.server_max_window_bits = std::max(9, std::min(15, result.server_max_window_bits));
+      // The client's window can only be limited if the client says it supports the parameter
+      if(client_max_window_bits_offered)
+        result.client_max_window_bits = std::max(9, std::min(client_max_window_bits, options.client_max_window_bits));
+
+      response = "permessage-deflate";
+      if(result.server_no_context_takeover)
+        response += "; server_no_context_takeover";
+      if(result.client_no_context_takeover)
+        response += "; client_no_context_takeover";
+      if(result.server_max_window_bits < 15)
+        response += "; server_max_window_bits=" + std::to_string(result.server_max_window_bits);
+      if(client_max_window_bits_offered && result.client_max_window_bits < 15)
+        response += "; client_max_window_bits=" + std::to_string(result.client_max_window_bits);
+      parameters = result;
+      return true;
+    }
+  };
+} // namespace SimpleWeb
+
+#endif /* SIMPLE_WEB_PERMESSAGE_DEFLATE_HPP */
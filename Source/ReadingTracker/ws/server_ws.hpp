@@ -4,15 +4,19 @@
 #include "asio_compatibility.hpp"
 #include "crypto.hpp"
 #include "mutex.hpp"
+#include "permessage_deflate.hpp"
 #include "utility.hpp"
 #include <array>
 #include <atomic>
 #include <iostream>
+#include <iterator>
 #include <limits>
 #include <list>
+#include <map>
 #include <memory>
 #include <thread>
 #include <unordered_set>
+#include <vector>
 
 // Late 2017 TODO: remove the following checks and always use std::regex
 #ifdef USE_BOOST_REGEX
@@ -33,6 +37,53 @@ namespace SimpleWeb {
 
   template <class socket_type>
   class SocketServerBase {
+  public:
+    /// High-water mark of a connection's send queue for one message class, see Config::send_queue_limits.
+    class SendQueueLimit {
+    public:
+      enum class Policy {
+        /// Remove the oldest queued messages of the class until the new message fits
+        drop_oldest,
+        /// Remove all queued messages of the class, only the new message is kept
+        keep_latest,
+        /// Close the connection
+        disconnect
+      };
+      /// Maximum number of queued messages of the class. 0 means no limit.
+      std::size_t max_messages = 0;
+      /// Maximum number of queued bytes of the class, frame headers included. 0 means no limit.
+      std::size_t max_bytes = 0;
+      Policy policy = Policy::drop_oldest;
+    };
+
+    /// Outbound priority lanes, see Connection::send().
+    /// Queued messages of the high lane are written before queued messages of the bulk lane. Messages of a lane keep their order.
+    enum class Lane {
+      high,
+      bulk
+    };
+
+    /// Send queue counters, see Connection::get_send_queue_statistics() and SocketServerBase::get_send_queue_statistics().
+    class SendQueueStatistics {
+    public:
+      /// Messages currently queued, including the message being written
+      std::size_t queued_messages = 0;
+      std::size_t queued_bytes = 0;
+      /// Messages removed from send queues by the drop_oldest and keep_latest policies
+      std::size_t dropped_messages = 0;
+      std::size_t dropped_bytes = 0;
+      /// Connections closed by the disconnect policy
+      std::size_t disconnects = 0;
+    };
+
+  private:
+    class SendQueueCounters {
+    public:
+      std::atomic<std::size_t> dropped_messages{0};
+      std::atomic<std::size_t> dropped_bytes{0};
+      std::atomic<std::size_t> disconnects{0};
+    };
+
   public:
     class InMessage : public std::istream {
       friend class SocketServerBase<socket_type>;
@@ -43,9 +94,16 @@ namespace SimpleWeb {
         return length;
       }
 
+      /// Returns the unread part of the payload without copying it, the bytes are stored contiguously.
+      /// Until the message is read through the std::istream interface, data() points to size() bytes.
+      /// The pointer is valid as long as the InMessage is alive.
+      const char *data() const noexcept {
+        return static_cast<const char *>(streambuf.data().data());
+      }
+
       /// Convenience function to return std::string.
       std::string string() noexcept {
-        return std::string(asio::buffers_begin(streambuf.data()), asio::buffers_end(streambuf.data()));
+        return std::string(data(), streambuf.size());
       }
 
     private:
@@ -79,7 +137,7 @@ namespace SimpleWeb {
       friend class SocketServer<socket_type>;
 
     public:
-      Connection(std::unique_ptr<socket_type> &&socket_) noexcept : socket(std::move(socket_)), timeout_idle(0), closed(false) {}
+      Connection(std::unique_ptr<socket_type> &&socket_) noexcept : socket(std::move(socket_)), strand(make_strand(*socket)), timeout_idle(0), closed(false) {}
 
       std::string method, path, query_string, http_version;
 
@@ -87,16 +145,23 @@ namespace SimpleWeb {
 
       regex::smatch path_match;
 
+      /// The subprotocol selected in Endpoint::on_handshake through the Sec-WebSocket-Protocol response header field, empty if none.
+      std::string subprotocol;
+
     private:
       /// Used to call SocketServer::upgrade.
       template <typename... Args>
       Connection(std::shared_ptr<ScopeRunner> handler_runner_, long timeout_idle, Args &&...args) noexcept
-          : handler_runner(std::move(handler_runner_)), socket(new socket_type(std::forward<Args>(args)...)), timeout_idle(timeout_idle), closed(false) {}
+          : handler_runner(std::move(handler_runner_)), socket(new socket_type(std::forward<Args>(args)...)), strand(make_strand(*socket)), timeout_idle(timeout_idle), closed(false) {}
 
       std::shared_ptr<ScopeRunner> handler_runner;
 
       std::unique_ptr<socket_type> socket; // Socket must be unique_ptr since asio::ssl::stream<asio::ip::tcp::socket> is not movable
 
+      /// All handlers of the connection run on this strand, and operations on the socket are started from it,
+      /// thus the server can run on several threads. Sends from other threads are posted to the strand.
+      SimpleWeb::strand strand;
+
       asio::streambuf streambuf;
       std::shared_ptr<InMessage> fragmented_in_message;
 
@@ -109,6 +174,17 @@ namespace SimpleWeb {
 
       asio::ip::tcp::endpoint endpoint; // The endpoint is read in SocketServer::write_handshake and must be stored so that it can be read reliably in all handlers, including on_error
 
+      /// Set in SocketServer::write_handshake if the client and the server agreed on permessage-deflate
+      std::unique_ptr<PermessageDeflate> permessage_deflate;
+      std::size_t compression_threshold = 0;
+
+      /// Copied from Config::send_queue_limits in SocketServer::write_handshake
+      std::map<int, SendQueueLimit> send_queue_limits;
+      /// Server wide counters of messages dropped and connections closed by the send queue limits
+      std::shared_ptr<SendQueueCounters> send_queue_counters;
+      /// Copied from Config::max_write_size in SocketServer::write_handshake
+      std::size_t max_write_size = (std::numeric_limits<std::size_t>::max)();
+
       void set_timeout(long seconds = -1) noexcept {
         if(seconds == -1)
           seconds = timeout_idle;
@@ -122,12 +198,12 @@ namespace SimpleWeb {
 
         timer = make_steady_timer(*socket, std::chrono::seconds(seconds));
         std::weak_ptr<Connection> connection_weak(this->shared_from_this()); // To avoid keeping Connection instance alive longer than needed
-        timer->async_wait([connection_weak](const error_code &ec) {
+        timer->async_wait(bind_strand(strand, [connection_weak](const error_code &ec) {
           if(!ec) {
             if(auto connection = connection_weak.lock())
               connection->close(); // Servers are not required to send close frames
           }
-        });
+        }));
       }
 
       void cancel_timeout() noexcept {
@@ -143,97 +219,262 @@ namespace SimpleWeb {
 
       class OutData {
       public:
-        OutData(std::shared_ptr<OutMessage> out_header_, std::shared_ptr<OutMessage> out_message_,
+        OutData(std::shared_ptr<OutMessage> out_header_, std::shared_ptr<OutMessage> out_message_, unsigned char fin_rsv_opcode_, int message_class_, Lane lane_,
                 std::function<void(const error_code)> &&callback_) noexcept
-            : out_header(std::move(out_header_)), out_message(std::move(out_message_)), callback(std::move(callback_)) {}
+            : out_header(std::move(out_header_)), out_message(std::move(out_message_)), fin_rsv_opcode(fin_rsv_opcode_), message_class(message_class_), lane(lane_),
+              size(out_header->size() + out_message->size()), callback(std::move(callback_)) {}
         std::shared_ptr<OutMessage> out_header;
         std::shared_ptr<OutMessage> out_message;
+        unsigned char fin_rsv_opcode;
+        int message_class;
+        Lane lane;
+        std::size_t size; // Size when queued, before compression
         std::function<void(const error_code)> callback;
       };
 
+      class QueueUsage {
+      public:
+        std::size_t messages = 0;
+        std::size_t bytes = 0;
+      };
+
       Mutex send_queue_mutex;
       std::list<OutData> send_queue GUARDED_BY(send_queue_mutex);
+      /// Number of messages at the front of send_queue that are being written
+      std::size_t send_queue_writing GUARDED_BY(send_queue_mutex) = 0;
+      /// True from the moment a write is posted to the strand until send_queue is empty
+      bool send_queue_active GUARDED_BY(send_queue_mutex) = false;
+      std::map<int, QueueUsage> send_queue_usage GUARDED_BY(send_queue_mutex);
+      SendQueueStatistics send_queue_statistics GUARDED_BY(send_queue_mutex);
+
+      void add_usage(const OutData &out_data) REQUIRES(send_queue_mutex) {
+        auto &usage = send_queue_usage[out_data.message_class];
+        ++usage.messages;
+        usage.bytes += out_data.size;
+        ++send_queue_statistics.queued_messages;
+        send_queue_statistics.queued_bytes += out_data.size;
+      }
 
-      /// send_queue_mutex must be locked here
-      void send_from_queue() REQUIRES(send_queue_mutex) {
-        std::array<asio::const_buffer, 2> buffers{send_queue.begin()->out_header->streambuf.data(), send_queue.begin()->out_message->streambuf.data()};
+      void remove_usage(const OutData &out_data) REQUIRES(send_queue_mutex) {
+        auto &usage = send_queue_usage[out_data.message_class];
+        --usage.messages;
+        usage.bytes -= out_data.size;
+        --send_queue_statistics.queued_messages;
+        send_queue_statistics.queued_bytes -= out_data.size;
+      }
+
+      /// A frame of the batch being written, compressed if permessage-deflate is used. Only used on the strand.
+      class WriteFrame {
+      public:
+        std::shared_ptr<OutMessage> out_header;
+        std::shared_ptr<OutMessage> out_message;
+        unsigned char fin_rsv_opcode;
+      };
+      std::vector<WriteFrame> write_frames;
+      /// Header and message buffers of write_frames
+      std::vector<asio::const_buffer> send_buffers;
+
+      /// Writes the queued messages with one gathered write, up to max_write_size bytes and at least one message.
+      /// Must be called on the strand. The batch is taken under send_queue_mutex and compressed after it is released,
+      /// so send_frame, called from other threads, never waits for deflate.
+      void send_from_queue() EXCLUDES(send_queue_mutex) {
+        write_frames.clear();
+        {
+          LockGuard lock(send_queue_mutex);
+          if(send_queue.empty()) { // The queued messages were dropped before the posted write started
+            send_queue_active = false;
+            return;
+          }
+          std::size_t write_size = 0;
+          for(auto &out_data : send_queue) {
+            // Sizes before compression are used, since a message must not be compressed unless it is written now
+            if(send_queue_writing > 0 && write_size + out_data.size > max_write_size)
+              break;
+            write_size += out_data.size;
+            write_frames.push_back(WriteFrame{out_data.out_header, out_data.out_message, out_data.fin_rsv_opcode});
+            ++send_queue_writing;
+          }
+        }
+        // The messages being written are neither dropped nor overtaken by send_frame, and only this strand compresses,
+        // thus the deflate stream still sees the messages in the order they reach the client
+        send_buffers.clear();
+        for(auto &frame : write_frames) {
+          compress(frame);
+          send_buffers.emplace_back(frame.out_header->streambuf.data());
+          send_buffers.emplace_back(frame.out_message->streambuf.data());
+        }
         auto self = this->shared_from_this();
         set_timeout();
-        asio::async_write(*socket, buffers, [self](const error_code &ec, std::size_t /*bytes_transferred*/) {
+        asio::async_write(*socket, send_buffers, bind_strand(strand, [self](const error_code &ec, std::size_t /*bytes_transferred*/) {
           self->set_timeout(); // Set timeout for next send
           auto lock = self->handler_runner->continue_lock();
           if(!lock)
             return;
+          std::vector<std::function<void(const error_code &)>> callbacks;
+          bool send_more = false;
           {
             LockGuard lock(self->send_queue_mutex);
             if(!ec) {
-              auto it = self->send_queue.begin();
-              auto callback = std::move(it->callback);
-              self->send_queue.erase(it);
+              // Callbacks of the written messages are called in order
+              for(; self->send_queue_writing > 0; --self->send_queue_writing) {
+                auto it = self->send_queue.begin();
+                if(it->callback)
+                  callbacks.emplace_back(std::move(it->callback));
+                self->remove_usage(*it);
+                self->send_queue.erase(it);
+              }
               if(self->send_queue.size() > 0)
-                self->send_from_queue();
-
-              lock.unlock();
-              if(callback)
-                callback(ec);
+                send_more = true;
+              else
+                self->send_queue_active = false;
             }
             else {
               // All handlers in the queue is called with ec:
-              std::vector<std::function<void(const error_code &)>> callbacks;
               for(auto &out_data : self->send_queue) {
                 if(out_data.callback)
                   callbacks.emplace_back(std::move(out_data.callback));
               }
               self->send_queue.clear();
-
-              lock.unlock();
-              for(auto &callback : callbacks)
-                callback(ec);
+              self->send_queue_writing = 0;
+              self->send_queue_active = false;
+              self->send_queue_usage.clear();
+              self->send_queue_statistics.queued_messages = 0;
+              self->send_queue_statistics.queued_bytes = 0;
             }
           }
-        });
+          self->write_frames.clear();
+          if(send_more)
+            self->send_from_queue();
+          for(auto &callback : callbacks)
+            callback(ec);
+        }));
       }
 
-    public:
-      /// fin_rsv_opcode: 129=one fragment, text, 130=one fragment, binary, 136=close connection.
-      /// See http://tools.ietf.org/html/rfc6455#section-5.2 for more information.
-      void send(std::shared_ptr<OutMessage> out_message, std::function<void(const error_code &)> callback = nullptr, unsigned char fin_rsv_opcode = 129) {
-        std::size_t length = out_message->size();
-
-        auto out_header = std::make_shared<OutMessage>(10); // Header is at most 10 bytes
-
-        out_header->put(static_cast<char>(fin_rsv_opcode));
-        // Unmasked (first length byte<128)
-        if(length >= 126) {
-          std::size_t num_bytes;
-          if(length > 0xffff) {
-            num_bytes = 8;
-            out_header->put(127);
+      /// Replaces a data frame by its compressed version if permessage-deflate is used on the connection.
+      /// Messages are compressed right before they are written, so that they reach the client in the order they were compressed.
+      void compress(WriteFrame &frame) {
+        auto opcode = frame.fin_rsv_opcode & 0x0f;
+        if(!permessage_deflate || (frame.fin_rsv_opcode & 0xf0) != 0x80 || (opcode != 1 && opcode != 2) || frame.out_message->size() < compression_threshold)
+          return;
+        // The shared buffers of a broadcast are left untouched, the compressed frame belongs to this connection only
+        auto out_message = std::make_shared<OutMessage>();
+        if(permessage_deflate->compress(static_cast<const char *>(frame.out_message->streambuf.data().data()), frame.out_message->size(), out_message->streambuf)) {
+          frame.fin_rsv_opcode |= 0x40; // RSV1: compressed message
+          frame.out_header = make_frame_header(out_message->size(), frame.fin_rsv_opcode);
+          frame.out_message = std::move(out_message);
+        }
+      }
+
+      /// Queues an already encoded frame. The header and message buffers can be shared with other connections.
+      /// Data frames are subject to the send queue limit of their message class, control frames are always queued.
+      /// A message is queued after the messages of its own and of higher priority lanes that are waiting to be written.
+      void send_frame(std::shared_ptr<OutMessage> out_header, std::shared_ptr<OutMessage> out_message, unsigned char fin_rsv_opcode, int message_class, Lane lane, std::function<void(const error_code &)> callback) {
+        std::vector<std::function<void(const error_code &)>> dropped_callbacks;
+        bool disconnect = false;
+        {
+          LockGuard lock(send_queue_mutex);
+          // A close frame must not be overtaken by messages that were queued before it
+          if((fin_rsv_opcode & 0x0f) == 8)
+            lane = Lane::bulk;
+          OutData out_data(std::move(out_header), std::move(out_message), fin_rsv_opcode, message_class, lane, std::move(callback));
+          auto limit_it = (fin_rsv_opcode & 0x0f) < 8 ? send_queue_limits.find(message_class) : send_queue_limits.end();
+          if(limit_it != send_queue_limits.end()) {
+            auto &limit = limit_it->second;
+            auto &usage = send_queue_usage[message_class];
+            auto exceeded = [&limit, &usage, &out_data] {
+              return (limit.max_messages > 0 && usage.messages + 1 > limit.max_messages) ||
+                     (limit.max_bytes > 0 && usage.bytes + out_data.size > limit.max_bytes);
+            };
+            if(exceeded()) {
+              if(limit.policy == SendQueueLimit::Policy::disconnect)
+                disconnect = true;
+              else {
+                // The messages being written cannot be removed
+                auto it = std::next(send_queue.begin(), static_cast<std::ptrdiff_t>(send_queue_writing));
+                while(it != send_queue.end() && (limit.policy == SendQueueLimit::Policy::keep_latest || exceeded())) {
+                  if(it->message_class == message_class && (it->fin_rsv_opcode & 0x0f) < 8) {
+                    if(it->callback)
+                      dropped_callbacks.emplace_back(std::move(it->callback));
+                    ++send_queue_statistics.dropped_messages;
+                    send_queue_statistics.dropped_bytes += it->size;
+                    if(send_queue_counters) {
+                      ++send_queue_counters->dropped_messages;
+                      send_queue_counters->dropped_bytes += it->size;
+                    }
+                    remove_usage(*it);
+                    it = send_queue.erase(it);
+                  }
+                  else
+                    ++it;
+                }
+              }
+            }
+          }
+
+          if(disconnect) {
+            ++send_queue_statistics.disconnects;
+            if(send_queue_counters)
+              ++send_queue_counters->disconnects;
+            dropped_callbacks.emplace_back(std::move(out_data.callback));
           }
           else {
-            num_bytes = 2;
-            out_header->put(126);
+            add_usage(out_data);
+            // Waiting messages are ordered by lane, thus the insertion point is searched from the back.
+            // Data frames of different messages must not be interleaved (RFC 6455, section 5.4),
+            // thus a message is never moved before a continuation frame.
+            auto it = send_queue.end();
+            auto first_waiting = std::next(send_queue.begin(), static_cast<std::ptrdiff_t>(send_queue_writing));
+            while(it != first_waiting && std::prev(it)->lane > out_data.lane)
+              --it;
+            while(it != send_queue.end() && (it->fin_rsv_opcode & 0x0f) == 0)
+              ++it;
+            send_queue.insert(it, std::move(out_data));
+            if(!send_queue_active) {
+              send_queue_active = true;
+              auto self = this->shared_from_this();
+              post(strand, [self] {
+                self->send_from_queue();
+              });
+            }
           }
+        }
 
-          for(std::size_t c = num_bytes - 1; c != static_cast<std::size_t>(-1); c--)
-            out_header->put((static_cast<unsigned long long>(length) >> (8 * c)) % 256);
+        for(auto &dropped_callback : dropped_callbacks) {
+          if(dropped_callback)
+            dropped_callback(make_error_code::make_error_code(errc::operation_canceled));
         }
-        else
-          out_header->put(static_cast<char>(length));
+        if(disconnect) {
+          auto self = this->shared_from_this();
+          post(strand, [self] {
+            self->close();
+          });
+        }
+      }
 
-        LockGuard lock(send_queue_mutex);
-        send_queue.emplace_back(std::move(out_header), std::move(out_message), std::move(callback));
-        if(send_queue.size() == 1)
-          send_from_queue();
+    public:
+      /// fin_rsv_opcode: 129=one fragment, text, 130=one fragment, binary, 136=close connection.
+      /// See http://tools.ietf.org/html/rfc6455#section-5.2 for more information.
+      /// message_class: selects the send queue limit in Config::send_queue_limits.
+      /// If the message is dropped by a send queue limit, callback is called with operation_canceled.
+      /// lane: messages of the high lane are written before waiting messages of the bulk lane.
+      void send(std::shared_ptr<OutMessage> out_message, std::function<void(const error_code &)> callback = nullptr, unsigned char fin_rsv_opcode = 129, int message_class = 0, Lane lane = Lane::high) {
+        auto out_header = make_frame_header(out_message->size(), fin_rsv_opcode);
+        send_frame(std::move(out_header), std::move(out_message), fin_rsv_opcode, message_class, lane, std::move(callback));
       }
 
       /// Convenience function for sending a string.
       /// fin_rsv_opcode: 129=one fragment, text, 130=one fragment, binary, 136=close connection.
       /// See http://tools.ietf.org/html/rfc6455#section-5.2 for more information.
-      void send(string_view out_message_str, std::function<void(const error_code &)> callback = nullptr, unsigned char fin_rsv_opcode = 129) {
+      void send(string_view out_message_str, std::function<void(const error_code &)> callback = nullptr, unsigned char fin_rsv_opcode = 129, int message_class = 0, Lane lane = Lane::high) {
         auto out_message = std::make_shared<OutMessage>();
         out_message->write(out_message_str.data(), static_cast<std::streamsize>(out_message_str.size()));
-        send(out_message, std::move(callback), fin_rsv_opcode);
+        send(out_message, std::move(callback), fin_rsv_opcode, message_class, lane);
+      }
+
+      /// Returns the send queue counters of this connection.
+      SendQueueStatistics get_send_queue_statistics() noexcept {
+        LockGuard lock(send_queue_mutex);
+        return send_queue_statistics;
       }
 
       void send_close(int status, const std::string &reason = "", std::function<void(const error_code &)> callback = nullptr) {
@@ -304,6 +545,7 @@ namespace SimpleWeb {
 
     public:
       std::function<StatusCode(std::shared_ptr<Connection>, CaseInsensitiveMultimap &)> on_handshake;
+      /// Unless the server is stopped first, on_close or on_error is called exactly once for every connection passed to on_open, and never for other connections
       std::function<void(std::shared_ptr<Connection>)> on_open;
       std::function<void(std::shared_ptr<Connection>, std::shared_ptr<InMessage>)> on_message;
       std::function<void(std::shared_ptr<Connection>, int, const std::string &)> on_close;
@@ -346,6 +588,15 @@ namespace SimpleWeb {
       bool reuse_address = true;
       /// Make use of RFC 7413 or TCP Fast Open (TFO)
       bool fast_open = false;
+      /// permessage-deflate (RFC 7692) compression. Disabled by default.
+      /// Context takeover and window sizes are negotiated with each client within the limits set here.
+      PermessageDeflate::Options permessage_deflate;
+      /// Maximum number of bytes of queued messages that are gathered into one write. At least one message is always written.
+      /// Defaults to 256 KiB.
+      std::size_t max_write_size = 256 * 1024;
+      /// Send queue high-water marks per message class, see Connection::send().
+      /// Message classes without an entry are not limited. Control frames are never limited or dropped.
+      std::map<int, SendQueueLimit> send_queue_limits;
     };
     /// Set before calling start().
     Config config;
@@ -475,6 +726,40 @@ namespace SimpleWeb {
 
     virtual ~SocketServerBase() noexcept {}
 
+    /// Sends out_message to all connections of all endpoints.
+    /// The frame header is encoded once, and the header and message buffers are shared by the send queues of all the connections,
+    /// thus out_message must not be altered afterwards.
+    /// fin_rsv_opcode: 129=one fragment, text, 130=one fragment, binary.
+    /// message_class: selects the send queue limit in Config::send_queue_limits.
+    /// lane: messages of the high lane are written before waiting messages of the bulk lane.
+    /// filter: if set, the message is only sent to the connections for which it returns true, for instance the connections of a subprotocol.
+    void broadcast(const std::shared_ptr<OutMessage> &out_message, unsigned char fin_rsv_opcode = 129, int message_class = 0, Lane lane = Lane::high,
+                   const std::function<bool(const std::shared_ptr<Connection> &)> &filter = nullptr) {
+      auto out_header = make_frame_header(out_message->size(), fin_rsv_opcode);
+      for(auto &e : endpoint) {
+        LockGuard lock(e.second.connections_mutex);
+        for(auto &connection : e.second.connections) {
+          if(!filter || filter(connection))
+            connection->send_frame(out_header, out_message, fin_rsv_opcode, message_class, lane, nullptr);
+        }
+      }
+    }
+
+    /// Returns the messages queued on all current connections,
+    /// and the messages dropped and connections closed by the send queue limits since the server was created.
+    SendQueueStatistics get_send_queue_statistics() noexcept {
+      SendQueueStatistics statistics;
+      for(auto &connection : get_connections()) {
+        auto connection_statistics = connection->get_send_queue_statistics();
+        statistics.queued_messages += connection_statistics.queued_messages;
+        statistics.queued_bytes += connection_statistics.queued_bytes;
+      }
+      statistics.dropped_messages = send_queue_counters->dropped_messages;
+      statistics.dropped_bytes = send_queue_counters->dropped_bytes;
+      statistics.disconnects = send_queue_counters->disconnects;
+      return statistics;
+    }
+
     std::unordered_set<std::shared_ptr<Connection>> get_connections() noexcept {
       std::unordered_set<std::shared_ptr<Connection>> all_connections;
       for(auto &e : endpoint) {
@@ -520,14 +805,41 @@ namespace SimpleWeb {
 
     std::shared_ptr<ScopeRunner> handler_runner;
 
-    SocketServerBase(unsigned short port) noexcept : config(port), handler_runner(new ScopeRunner()) {}
+    std::shared_ptr<SendQueueCounters> send_queue_counters;
+
+    SocketServerBase(unsigned short port) noexcept : config(port), handler_runner(new ScopeRunner()), send_queue_counters(new SendQueueCounters()) {}
+
+    /// Returns the header of an unmasked frame with a payload of the given length.
+    static std::shared_ptr<OutMessage> make_frame_header(std::size_t length, unsigned char fin_rsv_opcode) {
+      auto out_header = std::make_shared<OutMessage>(10); // Header is at most 10 bytes
+
+      out_header->put(static_cast<char>(fin_rsv_opcode));
+      // Unmasked (first length byte<128)
+      if(length >= 126) {
+        std::size_t num_bytes;
+        if(length > 0xffff) {
+          num_bytes = 8;
+          out_header->put(127);
+        }
+        else {
+          num_bytes = 2;
+          out_header->put(126);
+        }
+
+        for(std::size_t c = num_bytes - 1; c != static_cast<std::size_t>(-1); c--)
+          out_header->put((static_cast<unsigned long long>(length) >> (8 * c)) % 256);
+      }
+      else
+        out_header->put(static_cast<char>(length));
+      return out_header;
+    }
 
     virtual void after_bind() {}
     virtual void accept() = 0;
 
     void read_handshake(const std::shared_ptr<Connection> &connection) {
       connection->set_timeout(config.timeout_request);
-      asio::async_read_until(*connection->socket, connection->streambuf, "\r\n\r\n", [this, connection](const error_code &ec, std::size_t /*bytes_transferred*/) {
+      asio::async_read_until(*connection->socket, connection->streambuf, "\r\n\r\n", bind_strand(connection->strand, [this, connection](const error_code &ec, std::size_t /*bytes_transferred*/) {
         connection->cancel_timeout();
         auto lock = connection->handler_runner->continue_lock();
         if(!lock)
@@ -537,7 +849,7 @@ namespace SimpleWeb {
           if(RequestMessage::parse(istream, connection->method, connection->path, connection->query_string, connection->http_version, connection->header))
             write_handshake(connection);
         }
-      });
+      }));
     }
 
     void write_handshake(const std::shared_ptr<Connection> &connection) {
@@ -559,6 +871,19 @@ namespace SimpleWeb {
             auto sha1 = Crypto::sha1(key_it->second + ws_magic_string);
             response_header.emplace("Sec-WebSocket-Accept", Crypto::Base64::encode(sha1));
 
+            if(config.permessage_deflate.enabled) {
+              PermessageDeflate::Parameters parameters;
+              std::string extension;
+              if(PermessageDeflate::negotiate(connection->header, config.permessage_deflate, parameters, extension)) {
+                response_header.emplace("Sec-WebSocket-Extensions", extension);
+                connection->permessage_deflate = std::unique_ptr<PermessageDeflate>(new PermessageDeflate(parameters, config.permessage_deflate.compression_level));
+                connection->compression_threshold = config.permessage_deflate.compression_threshold;
+              }
+            }
+            connection->send_queue_limits = config.send_queue_limits;
+            connection->send_queue_counters = send_queue_counters;
+            connection->max_write_size = config.max_write_size;
+
             try {
               connection->endpoint = connection->socket->lowest_layer().remote_endpoint();
             }
@@ -569,6 +894,9 @@ namespace SimpleWeb {
               status_code = regex_endpoint.second.on_handshake(connection, response_header);
 
             if(status_code == StatusCode::information_switching_protocols) {
+              auto subprotocol_it = response_header.find("Sec-WebSocket-Protocol");
+              if(subprotocol_it != response_header.end())
+                connection->subprotocol = subprotocol_it->second;
               ostream << "HTTP/1.1 101 Web Socket Protocol Handshake\r\n";
               for(auto &header_field : response_header)
                 ostream << header_field.first << ": " << header_field.second << "\r\n";
@@ -580,7 +908,7 @@ namespace SimpleWeb {
 
           connection->path_match = std::move(path_match);
           connection->set_timeout(config.timeout_request);
-          asio::async_write(*connection->socket, *streambuf, [this, connection, streambuf, &regex_endpoint, status_code](const error_code &ec, std::size_t /*bytes_transferred*/) {
+          asio::async_write(*connection->socket, *streambuf, bind_strand(connection->strand, [this, connection, streambuf, &regex_endpoint, status_code](const error_code &ec, std::size_t /*bytes_transferred*/) {
             connection->cancel_timeout();
             auto lock = connection->handler_runner->continue_lock();
             if(!lock)
@@ -588,13 +916,12 @@ namespace SimpleWeb {
             if(status_code != StatusCode::information_switching_protocols)
               return;
 
+            // A failed handshake is not reported to on_error: the connection was never opened
             if(!ec) {
               connection_open(connection, regex_endpoint.second);
               read_message(connection, regex_endpoint.second);
             }
-            else
-              connection_error(connection, regex_endpoint.second, ec);
-          });
+          }));
           return;
         }
       }
@@ -602,7 +929,7 @@ namespace SimpleWeb {
 
     void read_message(const std::shared_ptr<Connection> &connection, Endpoint &endpoint) const {
       connection->set_timeout();
-      asio::async_read(*connection->socket, connection->streambuf, asio::transfer_exactly(2), [this, connection, &endpoint](const error_code &ec, std::size_t bytes_transferred) {
+      asio::async_read(*connection->socket, connection->streambuf, asio::transfer_exactly(2), bind_strand(connection->strand, [this, connection, &endpoint](const error_code &ec, std::size_t bytes_transferred) {
         connection->cancel_timeout();
         auto lock = connection->handler_runner->continue_lock();
         if(!lock)
@@ -632,7 +959,7 @@ namespace SimpleWeb {
           if(length == 126) {
             // 2 next bytes is the size of content
             connection->set_timeout();
-            asio::async_read(*connection->socket, connection->streambuf, asio::transfer_exactly(2), [this, connection, &endpoint, fin_rsv_opcode](const error_code &ec, std::size_t /*bytes_transferred*/) {
+            asio::async_read(*connection->socket, connection->streambuf, asio::transfer_exactly(2), bind_strand(connection->strand, [this, connection, &endpoint, fin_rsv_opcode](const error_code &ec, std::size_t /*bytes_transferred*/) {
               connection->cancel_timeout();
               auto lock = connection->handler_runner->continue_lock();
               if(!lock)
@@ -652,12 +979,12 @@ namespace SimpleWeb {
               }
               else
                 connection_error(connection, endpoint, ec);
-            });
+            }));
           }
           else if(length == 127) {
             // 8 next bytes is the size of content
             connection->set_timeout();
-            asio::async_read(*connection->socket, connection->streambuf, asio::transfer_exactly(8), [this, connection, &endpoint, fin_rsv_opcode](const error_code &ec, std::size_t /*bytes_transferred*/) {
+            asio::async_read(*connection->socket, connection->streambuf, asio::transfer_exactly(8), bind_strand(connection->strand, [this, connection, &endpoint, fin_rsv_opcode](const error_code &ec, std::size_t /*bytes_transferred*/) {
               connection->cancel_timeout();
               auto lock = connection->handler_runner->continue_lock();
               if(!lock)
@@ -677,19 +1004,18 @@ namespace SimpleWeb {
               }
               else
                 connection_error(connection, endpoint, ec);
-            });
+            }));
           }
           else
             read_message_content(connection, length, endpoint, fin_rsv_opcode);
         }
         else
           connection_error(connection, endpoint, ec);
-      });
+      }));
     }
 
     void read_message_content(const std::shared_ptr<Connection> &connection, std::size_t length, Endpoint &endpoint, unsigned char fin_rsv_opcode) const {
       if(length + (connection->fragmented_in_message ? connection->fragmented_in_message->length : 0) > config.max_message_size) {
-        connection_error(connection, endpoint, make_error_code::make_error_code(errc::message_size));
         const int status = 1009;
         const std::string reason = "message too big";
         connection->send_close(status, reason);
@@ -697,7 +1023,7 @@ namespace SimpleWeb {
         return;
       }
       connection->set_timeout();
-      asio::async_read(*connection->socket, connection->streambuf, asio::transfer_exactly(4 + length), [this, connection, length, &endpoint, fin_rsv_opcode](const error_code &ec, std::size_t /*bytes_transferred*/) {
+      asio::async_read(*connection->socket, connection->streambuf, asio::transfer_exactly(4 + length), bind_strand(connection->strand, [this, connection, length, &endpoint, fin_rsv_opcode](const error_code &ec, std::size_t /*bytes_transferred*/) {
         connection->cancel_timeout();
         auto lock = connection->handler_runner->continue_lock();
         if(!lock)
@@ -723,9 +1049,12 @@ namespace SimpleWeb {
           }
           else
             in_message = std::shared_ptr<InMessage>(new InMessage(fin_rsv_opcode, length));
-          std::ostream ostream(&in_message->streambuf);
-          for(std::size_t c = 0; c < length; c++)
-            ostream.put(istream.get() ^ mask[c % 4]);
+          // Unmask directly from the receive buffer into the message buffer, both asio::streambuf storages are contiguous
+          auto source = static_cast<const unsigned char *>(connection->streambuf.data().data());
+          auto destination = static_cast<unsigned char *>(in_message->streambuf.prepare(length).data());
+          apply_mask(source, destination, length, mask);
+          in_message->streambuf.commit(length);
+          connection->streambuf.consume(length);
 
           // If connection close
           if((fin_rsv_opcode & 0x0f) == 8) {
@@ -767,6 +1096,35 @@ namespace SimpleWeb {
             this->read_message(connection, endpoint);
           }
           else {
+            // If compressed message (RSV1 is set in the first frame of the message)
+            if((in_message->fin_rsv_opcode & 0x40) != 0) {
+              if(!connection->permessage_deflate) {
+                const std::string reason("compressed message without permessage-deflate");
+                connection->send_close(1002, reason);
+                this->connection_close(connection, endpoint, 1002, reason);
+                return;
+              }
+              auto inflated_message = std::shared_ptr<InMessage>(new InMessage(in_message->fin_rsv_opcode & ~0x40, 0));
+              if(!connection->permessage_deflate->decompress(in_message->data(), in_message->streambuf.size(), inflated_message->streambuf, config.max_message_size)) {
+                // Reported through on_close only, like the other close codes, so on_error and on_close are not both called
+                if(inflated_message->streambuf.size() > config.max_message_size) {
+                  const int status = 1009;
+                  const std::string reason = "message too big";
+                  connection->send_close(status, reason);
+                  this->connection_close(connection, endpoint, status, reason);
+                }
+                else {
+                  const int status = 1007;
+                  const std::string reason = "invalid compressed message";
+                  connection->send_close(status, reason);
+                  this->connection_close(connection, endpoint, status, reason);
+                }
+                return;
+              }
+              inflated_message->length = inflated_message->streambuf.size();
+              in_message = std::move(inflated_message);
+            }
+
             if(endpoint.on_message)
               endpoint.on_message(connection, in_message);
 
@@ -778,7 +1136,7 @@ namespace SimpleWeb {
         }
         else
           this->connection_error(connection, endpoint, ec);
-      });
+      }));
     }
 
     void connection_open(const std::shared_ptr<Connection> &connection, Endpoint &endpoint) const {
@@ -791,10 +1149,12 @@ namespace SimpleWeb {
         endpoint.on_open(connection);
     }
 
+    /// on_close and on_error are only called by the first of these for a connection, that removes it from the endpoint
     void connection_close(const std::shared_ptr<Connection> &connection, Endpoint &endpoint, int status, const std::string &reason) const {
       {
         LockGuard lock(endpoint.connections_mutex);
-        endpoint.connections.erase(connection);
+        if(endpoint.connections.erase(connection) == 0)
+          return;
       }
 
       if(endpoint.on_close)
@@ -804,7 +1164,8 @@ namespace SimpleWeb {
     void connection_error(const std::shared_ptr<Connection> &connection, Endpoint &endpoint, const error_code &ec) const {
       {
         LockGuard lock(endpoint.connections_mutex);
-        endpoint.connections.erase(connection);
+        if(endpoint.connections.erase(connection) == 0)
+          return;
       }
 
       if(endpoint.on_error)
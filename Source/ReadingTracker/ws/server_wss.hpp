@@ -78,14 +78,14 @@ namespace SimpleWeb {
           connection->socket->lowest_layer().set_option(option);
 
           connection->set_timeout(config.timeout_request);
-          connection->socket->async_handshake(asio::ssl::stream_base::server, [this, connection](const error_code &ec) {
+          connection->socket->async_handshake(asio::ssl::stream_base::server, bind_strand(connection->strand, [this, connection](const error_code &ec) {
             connection->cancel_timeout();
             auto lock = connection->handler_runner->continue_lock();
             if(!lock)
               return;
             if(!ec)
               read_handshake(connection);
-          });
+          }));
         }
       });
     }
@@ -2,9 +2,12 @@
 #define SIMPLE_WEB_UTILITY_HPP
 
 #include "status_code.hpp"
+#include <array>
 #include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <iostream>
 #include <memory>
@@ -477,4 +480,48 @@ namespace SimpleWeb {
   };
 } // namespace SimpleWeb
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMPLE_WEB_MASK_AVX2
+#endif
+#if defined(__SSE2__) || (defined(_MSC_VER) && (defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)))
+#include <emmintrin.h>
+#define SIMPLE_WEB_MASK_SSE2
+#endif
+
+namespace SimpleWeb {
+  /// XORs size bytes from source with the 4 byte frame mask (RFC 6455, section 5.3) and stores them in destination.
+  /// The mask is applied from mask[0], that is, source must point to the first payload byte of a frame.
+  /// Source and destination may be the same buffer.
+  inline void apply_mask(const unsigned char *source, unsigned char *destination, std::size_t size, const std::array<unsigned char, 4> &mask) noexcept {
+    // The mask repeats every 4 bytes, so any block size that is a multiple of 4 can use a widened copy of it
+    std::uint32_t mask32;
+    std::memcpy(&mask32, mask.data(), sizeof(mask32));
+    std::size_t c = 0;
+#ifdef SIMPLE_WEB_MASK_AVX2
+    const __m256i mask256 = _mm256_set1_epi32(static_cast<int>(mask32));
+    for(; c + 32 <= size; c += 32) {
+      __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(source + c));
+      _mm256_storeu_si256(reinterpret_cast<__m256i *>(destination + c), _mm256_xor_si256(block, mask256));
+    }
+#endif
+#ifdef SIMPLE_WEB_MASK_SSE2
+    const __m128i mask128 = _mm_set1_epi32(static_cast<int>(mask32));
+    for(; c + 16 <= size; c += 16) {
+      __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(source + c));
+      _mm_storeu_si128(reinterpret_cast<__m128i *>(destination + c), _mm_xor_si128(block, mask128));
+    }
+#endif
+    const std::uint64_t mask64 = (static_cast<std::uint64_t>(mask32) << 32) | mask32;
+    for(; c + 8 <= size; c += 8) {
+      std::uint64_t word;
+      std::memcpy(&word, source + c, sizeof(word));
+      word ^= mask64;
+      std::memcpy(destination + c, &word, sizeof(word));
+    }
+    for(; c < size; c++)
+      destination[c] = source[c] ^ mask[c % 4];
+  }
+} // namespace SimpleWeb
+
 #endif // SIMPLE_WEB_UTILITY_HPP